@@ -9,6 +9,8 @@ KERNEL_SECTORS equ 128       ; ~64 KB for kernel + GUI
 BOOTINFO_ADDR  equ 0x500    ; Boot info struct address
 BOOTINFO_MAGIC equ 0x4F594D42  ; "BMYO"
 VBE_INFO_BUF   equ 0x7E00   ; VBE mode info buffer (512 bytes)
+E820_BUF       equ 0x600    ; E820 memory map entries (24 bytes each)
+E820_END       equ 0x1000   ; Stop before the kernel image
 
 mov [BOOT_DRIVE], dl
 mov bp, 0x9000
@@ -17,6 +19,7 @@ mov sp, bp
 mov si, MSG_BOOT
 call print_16
 call load_kernel
+call detect_memory
 call setup_vesa
 call switch_to_pm
 jmp $
@@ -61,9 +64,6 @@ load_kernel:
     mov es, ax
     mov bx, KERNEL_OFFSET
     mov cx, KERNEL_SECTORS
-    mov byte [cur_sect], 2
-    mov byte [cur_head], 0
-    mov byte [cur_cyl], 0
 
 .read_loop:
     push cx
@@ -116,6 +116,37 @@ disk_error:
     call print_16
     jmp $
 
+; ============================================================
+; BIOS memory map (INT 15h, EAX=E820)
+; ============================================================
+
+; Collects E820 entries at E820_BUF and stores the count in bootinfo.
+; Also writes the bootinfo header for text mode; setup_vesa fills in
+; the framebuffer fields if a mode can be set.
+detect_memory:
+    xor eax, eax
+    mov dword [BOOTINFO_ADDR], BOOTINFO_MAGIC
+    mov [BOOTINFO_ADDR + 4], eax           ; no fb
+    mov [BOOTINFO_ADDR + 24], eax          ; vesa_mode = 0
+    mov [BOOTINFO_ADDR + 28], eax          ; mmap_count = 0
+
+    xor ebx, ebx
+    mov di, E820_BUF
+.next:
+    mov eax, 0xE820
+    mov edx, 'PAMS'                        ; "SMAP"
+    mov ecx, 24
+    int 0x15
+    jc .done
+    inc word [BOOTINFO_ADDR + 28]
+    add di, 24
+    cmp di, E820_END - 24
+    ja .done
+    test ebx, ebx
+    jnz .next
+.done:
+    ret
+
 ; ============================================================
 ; VESA Framebuffer Setup
 ; ============================================================
@@ -127,15 +158,9 @@ setup_vesa:
     jnc .vesa_ok
 
     ; Fallback: mode 0x112 (640x480x32bpp)
+    ; If this fails too, bootinfo stays in text mode
     mov cx, 0x112
     call try_vesa_mode
-    jnc .vesa_ok
-
-    ; No VESA - write text mode bootinfo
-    mov dword [BOOTINFO_ADDR], BOOTINFO_MAGIC
-    mov dword [BOOTINFO_ADDR + 4], 0       ; no fb
-    mov dword [BOOTINFO_ADDR + 24], 0      ; vesa_mode = 0
-    ret
 
 .vesa_ok:
     ret
@@ -165,7 +190,6 @@ try_vesa_mode:
     jne .fail
 
     ; Store bootinfo
-    mov dword [BOOTINFO_ADDR], BOOTINFO_MAGIC
     ; fb_addr = dword at VBE_INFO_BUF+40
     mov eax, [VBE_INFO_BUF + 40]
     mov [BOOTINFO_ADDR + 4], eax
@@ -206,7 +230,7 @@ DAP:
     dd 1
     dd 0
 
-cur_sect: db 0
+cur_sect: db 2
 cur_head: db 0
 cur_cyl:  db 0
 
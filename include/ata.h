@@ -13,6 +13,9 @@
 
 bool ata_init(void);
 bool ata_read_sectors(uint32_t lba, uint8_t count, void *buffer);
+bool ata_write_sectors(uint32_t lba, uint8_t count, const void *buffer);
+bool ata_flush(void);
 bool ata_secondary_present(void);
+uint32_t ata_get_sectors(void);
 
 #endif
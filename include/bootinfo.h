@@ -6,6 +6,23 @@
 #define BOOTINFO_ADDR  0x500
 #define BOOTINFO_MAGIC 0x4F594D42
 
+/* BIOS E820 memory map, collected by the bootloader below the kernel */
+#define BOOTINFO_MMAP_ADDR 0x600
+#define BOOTINFO_MMAP_MAX  105
+
+#define E820_USABLE   1
+#define E820_RESERVED 2
+#define E820_ACPI     3
+#define E820_NVS      4
+#define E820_BAD      5
+
+typedef struct {
+    uint64_t base;
+    uint64_t length;
+    uint32_t type;
+    uint32_t acpi;
+} __attribute__((packed)) e820_entry_t;
+
 typedef struct {
     uint32_t magic;
     uint32_t fb_addr;
@@ -14,9 +31,11 @@ typedef struct {
     uint32_t fb_pitch;
     uint32_t fb_bpp;
     uint32_t vesa_mode;
+    uint32_t mmap_count;
 } __attribute__((packed)) bootinfo_t;
 
 bootinfo_t *bootinfo_get(void);
 bool bootinfo_has_framebuffer(void);
+e820_entry_t *bootinfo_get_mmap(uint32_t *count);
 
 #endif
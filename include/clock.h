@@ -0,0 +1,17 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include "types.h"
+
+/*
+ * Monotonic high-resolution clock: the TSC, calibrated against the PIT at
+ * boot. Reading it is one rdtsc and a multiply, with no locking. Assumes
+ * a constant-rate TSC, which every CPU with PAE and NX in practice has.
+ */
+
+void     clock_init(void);
+uint32_t clock_tsc_khz(void);
+uint64_t clock_cycles(void);    /* TSC cycles since clock_init() */
+uint64_t clock_ns(void);        /* nanoseconds since clock_init() */
+
+#endif
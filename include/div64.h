@@ -0,0 +1,18 @@
+#ifndef DIV64_H
+#define DIV64_H
+
+#include "types.h"
+
+/*
+ * 64-by-32 unsigned division. There is no libgcc to provide __udivdi3,
+ * so split it into two divl steps: the high word first, then the low word
+ * with the high remainder in edx (which keeps the second quotient in range).
+ */
+static inline uint64_t div64_u32(uint64_t n, uint32_t d) {
+    uint32_t hi = (uint32_t)(n >> 32);
+    uint32_t q_lo, r;
+    __asm__("divl %4" : "=a"(q_lo), "=d"(r) : "a"((uint32_t)n), "d"(hi % d), "rm"(d));
+    return ((uint64_t)(hi / d) << 32) | q_lo;
+}
+
+#endif
@@ -24,6 +24,7 @@ typedef struct {
 void event_init(void);
 void event_push(event_t *e);
 bool event_poll(event_t *e);
+void event_wait(uint32_t ticks);
 
 void event_push_key(char key);
 void event_push_mouse_move(int x, int y);
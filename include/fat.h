@@ -18,9 +18,19 @@ typedef struct {
     uint8_t  attr;
 } fat_dir_entry_t;
 
+/* A run of consecutive clusters in a file's chain */
+typedef struct {
+    uint16_t cluster;
+    uint16_t count;
+} fat_run_t;
+
 bool fat_init(void);
 int  fat_list_root(fat_dir_entry_t *entries, int max_entries);
 int  fat_read_file(const char *filename, void *buffer, uint32_t max_size);
+bool fat_lookup(const char *filename, fat_dir_entry_t *out);
+int  fat_chain_runs(uint16_t first_cluster, fat_run_t *runs, int max_runs);
+int  fat_read_runs(const fat_run_t *runs, int run_count, uint32_t offset, void *buf, uint32_t len);
 bool fat_is_mounted(void);
+uint32_t fat_volume_sectors(void);
 
 #endif
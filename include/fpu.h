@@ -0,0 +1,24 @@
+#ifndef FPU_H
+#define FPU_H
+
+#include "types.h"
+
+/*
+ * x87/SSE state, switched lazily. CR0.TS is set whenever the task being
+ * switched in is not the one whose state sits in the FPU, so its first FPU
+ * or SSE instruction raises #NM (vector 7). The trap saves the previous
+ * owner's registers and loads the new task's. A task's 512-byte FXSAVE
+ * area is only allocated on that first use, so tasks that never touch the
+ * FPU cost nothing. Kernel tasks may use it too, but interrupt handlers
+ * must not: they would clobber the state of whatever task they interrupt.
+ */
+
+struct process;
+
+bool fpu_init(void);                    /* false if the CPU lacks FXSR/SSE */
+void fpu_switch(struct process *next);  /* before a context switch */
+bool fpu_trap(void);                    /* #NM; false if it can't be handled */
+bool fpu_fork(struct process *parent, struct process *child);
+void fpu_release(struct process *p);
+
+#endif
@@ -20,6 +20,7 @@ void irq_uninstall_handler(int irq);
 /* PIT timer */
 void pit_init(uint32_t frequency);
 uint32_t timer_get_ticks(void);
+void timer_nohz_enter(void);   /* idle, IRQs off: stop ticking until the next timer */
 
 /* Scheduler hook: called from the timer interrupt after EOI */
 void timer_set_scheduler(void (*callback)(void));
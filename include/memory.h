@@ -3,19 +3,228 @@
 
 #include "types.h"
 
-void pmm_init(uint32_t mem_size_kb);
+#define PAGE_SIZE       4096
+#define LARGE_PAGE_SIZE 0x200000   /* PAE large page */
+#define PMM_MAX_ORDER   10         /* Largest buddy block: 2^10 pages = 4 MB */
+
+/*
+ * Kernel virtual layout:
+ *   0x00000000 .. PHYS_DIRECT_LIMIT    identity map of RAM (PMM-managed)
+ *   USER_BASE  .. USER_TOP             per-process user space
+ *   KHEAP_BASE .. +KHEAP_MAX           kernel heap, backed page by page
+ *   KSTACK_BASE .. +KSTACK_AREA        kernel stacks, one window per task
+ *   KMMAP_BASE .. +KMMAP_AREA          kernel file mappings
+ *   KMAP_BASE  .. +KMAP_SLOTS pages    kmap() views of high memory
+ * Device windows such as the framebuffer stay at their physical address.
+ * Everything outside the user range is shared by all address spaces.
+ *
+ * The user stack grows down from USER_STACK_TOP and is backed on demand,
+ * one zeroed page per fault, up to USER_STACK_MAX. The page below that
+ * limit is never mapped, so an overflow faults.
+ */
+#define PHYS_DIRECT_LIMIT 0x40000000
+#define USER_BASE         0x40000000
+#define USER_TOP          0xC0000000
+#define USER_STACK_TOP    USER_TOP
+#define USER_STACK_MAX    0x00100000
+#define KHEAP_BASE        0xC0000000
+#define KHEAP_MAX         0x08000000
+#define KSTACK_BASE       0xD0000000
+#define KSTACK_AREA       0x01000000
+#define KMMAP_BASE        0xD1000000
+#define KMMAP_AREA        0x0EE00000
+#define KMAP_BASE         0xDFE00000
+#define KMAP_SLOTS        512      /* one page table */
+
+/*
+ * Page table entries are 64-bit (PAE). Kernel memory comes from the direct
+ * map and is kept as 32-bit physical addresses. User pages may be high
+ * memory, anywhere the PMM tracks (above 4GB included), so they are named
+ * by frame number instead.
+ */
+typedef uint64_t pte_t;
+
+#define PTE_FRAME   0x000FFFFFFFFFF000ULL
+#define PTE_PFN(e)  ((uint32_t)(((e) & PTE_FRAME) >> 12))
+
+/* Page table entry bits */
+#define PG_PRESENT  0x001
+#define PG_WRITE    0x002
+#define PG_USER     0x004
+#define PG_ACCESSED 0x020
+#define PG_COW      0x200      /* software bit: read-only until copied */
+#define PG_SWAPPED  0x400      /* in a non-present PTE: swap slot in bits 12+ */
+#define PG_NX       0x8000000000000000ULL
+
+/*
+ * A 64-bit entry takes two stores. Order them so the half holding the
+ * present bit is written last when mapping and first when unmapping, and
+ * the MMU never sees a present entry that is half old, half new.
+ */
+static inline void pte_set(pte_t *pte, pte_t val) {
+    volatile uint32_t *half = (volatile uint32_t *)pte;
+    if (val & PG_PRESENT) {
+        half[1] = (uint32_t)(val >> 32);
+        half[0] = (uint32_t)val;
+    } else {
+        half[0] = (uint32_t)val;
+        half[1] = (uint32_t)(val >> 32);
+    }
+}
+
+/* Page fault error code bits */
+#define PF_PRESENT  0x01
+#define PF_WRITE    0x02
+#define PF_USER     0x04
+#define PF_INSTR    0x10       /* instruction fetch (NX) */
+
+/* Memory type for a mapping (PAT-backed; WC degrades to UC without PAT) */
+typedef enum {
+    PAGE_CACHE_WB = 0,   /* Normal RAM */
+    PAGE_CACHE_WC,       /* Write-combining: framebuffers */
+    PAGE_CACHE_UC        /* Uncached: MMIO registers */
+} page_cache_t;
+
+/*
+ * Physical zones. Legacy and ISA DMA can only reach the low 16MB; ordinary
+ * allocations are steered away from it so drivers can still get pages there.
+ * ZONE_HIGH is RAM past the direct map; it only backs user pages.
+ */
+#define ZONE_DMA_LIMIT 0x1000000
+
+typedef enum {
+    ZONE_DMA = 0,
+    ZONE_NORMAL,
+    ZONE_HIGH,
+    ZONE_COUNT
+} pmm_zone_t;
+
+void pmm_init(void);
 void *pmm_alloc_page(void);
 void pmm_free_page(void *addr);
+void *pmm_alloc_pages(uint32_t order);   /* 2^order physically contiguous pages */
+void pmm_free_pages(void *addr, uint32_t order);
+uint32_t pmm_size_to_order(uint32_t size);
 uint32_t pmm_get_free_pages(void);
 uint32_t pmm_get_total_pages(void);
+uint32_t pmm_get_mem_top(void);         /* end of RAM in the direct map */
+uint32_t pmm_get_peak_pages(void);
+uint32_t pmm_get_zeroed_pages(void);
+uint32_t pmm_get_free_blocks(uint32_t order);
+uint32_t pmm_get_zone_free(pmm_zone_t zone);
+uint32_t pmm_get_zone_total(pmm_zone_t zone);
+void *pmm_alloc_dma(uint32_t order);     /* order <= 4; 0 if the DMA zone is exhausted */
+
+/* Pre-zeroed pages, refilled from idle loops */
+void *pmm_alloc_zeroed_page(void);
+bool pmm_idle(void);   /* background reclaim or zeroing; false if idle */
+
+/*
+ * Free-page watermarks. Below LOW, idle loops run the shrinkers until
+ * HIGH is reached; an allocation that fails runs them directly. Above
+ * LOW the spare time goes into the zero pool instead.
+ */
+#define PMM_WMARK_LOW   64
+#define PMM_WMARK_HIGH  128
+
+/*
+ * Shrinkers hand cached memory back under pressure. scan() is asked for
+ * `pages` pages and returns how many pages' worth it released (to the PMM
+ * or the heap); it may wait on disk but must not rely on allocating.
+ * Lower priority runs first, so cheap caches are emptied before anything
+ * costly such as swap.
+ */
+#define SHRINKER_MAX 8
+
+#define SHRINK_PRIO_FREE   0    /* pages held only as a convenience */
+#define SHRINK_PRIO_CACHE  10   /* clean data that can be reread */
+#define SHRINK_PRIO_SLAB   20   /* allocator slack */
+#define SHRINK_PRIO_SWAP   30   /* needs disk writes */
+
+typedef struct {
+    const char *name;
+    uint32_t (*scan)(uint32_t pages);
+    uint32_t priority;
+    uint32_t calls;
+    uint32_t freed;
+} shrinker_t;
+
+bool pmm_register_shrinker(const char *name, uint32_t (*scan)(uint32_t), uint32_t priority);
+uint32_t pmm_shrink(uint32_t pages);   /* pages freed */
+const shrinker_t *pmm_get_shrinkers(uint32_t *count);
+
+/* Sharing count of an allocated frame; pmm_page_put() frees it at zero */
+void pmm_page_get(uint32_t pfn);
+void pmm_page_put(uint32_t pfn);
+uint32_t pmm_page_refs(uint32_t pfn);
+
+/* User pages, high memory first; a frame number, 0 if out of memory */
+uint32_t pmm_alloc_user_frame(bool zero);
+void *kmap(uint32_t pfn);       /* kernel view of any frame; NULL if none free */
+void kunmap(void *addr);
 
 void paging_init(void);
-void paging_map_region(uint32_t virt, uint32_t phys, uint32_t size, uint32_t flags);
+uint32_t paging_get_identity_size(void);
+bool paging_has_nx(void);
+bool paging_has_pat(void);
+bool paging_map_region(uint32_t virt, uint32_t phys, uint32_t size, uint32_t flags,
+                       page_cache_t cache);
+bool paging_map_large(uint32_t virt, uint32_t phys, uint32_t size, uint32_t flags,
+                      page_cache_t cache);
+void paging_unmap_region(uint32_t virt, uint32_t size);
+void paging_batch_begin(void);   /* defer TLB flushes ... */
+void paging_batch_end(void);     /* ... and issue them together */
+uint32_t paging_batch_switch(uint32_t depth);   /* task switch: old depth */
+uint32_t paging_get_phys(uint32_t virt);   /* 0 if not mapped */
+void paging_expose_to_user(uint32_t start, uint32_t end);
+
+/* Address spaces, identified by the physical address of their PDPT */
+uint32_t paging_kernel_dir(void);
+uint32_t paging_create_space(void);
+uint32_t paging_clone_space(uint32_t dir);
+void paging_destroy_space(uint32_t dir);
+void paging_switch(uint32_t dir);
+bool paging_map_user(uint32_t dir, uint32_t virt, uint32_t pfn, uint32_t flags);
+uint32_t paging_unmap_user(uint32_t dir, uint32_t virt);   /* old frame, or 0 */
+void paging_invalidate(uint32_t dir, uint32_t virt);       /* after editing a PTE */
+pte_t *paging_user_pte(uint32_t dir, uint32_t virt);       /* NULL if no table */
+bool paging_handle_fault(uint32_t addr, uint32_t err);
+
+#define HEAP_HIST_BUCKETS 12   /* block sizes 16, 32, ... 32K, and larger */
+#define HEAP_SITES        16
+
+typedef struct {
+    uint32_t used;
+    uint32_t peak_used;
+    uint32_t free_bytes;         /* in free blocks, wilderness excluded */
+    uint32_t free_blocks;
+    uint32_t largest_free;
+    uint32_t frag_percent;       /* free space outside the largest block */
+    uint32_t wilderness;         /* free tail up to the end of the window */
+    uint32_t alloc_calls;
+    uint32_t free_calls;
+    uint32_t failed_allocs;
+    uint64_t alloc_cycles;
+    uint64_t free_cycles;
+    uint32_t live_hist[HEAP_HIST_BUCKETS];   /* live blocks by size class */
+} heap_stats_t;
+
+/* Live allocations attributed to one kmalloc() caller */
+typedef struct {
+    uint32_t caller;
+    uint32_t live_allocs;
+    uint32_t live_bytes;
+} heap_site_t;
 
 void heap_init(void);
 void *kmalloc(size_t size);
 void kfree(void *ptr);
 uint32_t heap_get_used(void);
 uint32_t heap_get_free(void);
+uint32_t heap_get_mapped(void);
+void heap_get_stats(heap_stats_t *stats);
+void heap_track_callers(bool enable);
+bool heap_tracking_callers(void);
+const heap_site_t *heap_get_sites(void);   /* HEAP_SITES entries, caller 0 = unused */
 
 #endif
@@ -0,0 +1,23 @@
+#ifndef MMAP_H
+#define MMAP_H
+
+#include "types.h"
+
+#define MMAP_MAX_REGIONS 16
+#define MMAP_WRITE       0x01   /* private, writable copy (user only) */
+
+/*
+ * Map a FAT file into `dir`: the kernel directory places it in the shared
+ * KMMAP window, any other into that process's user space. Returns the
+ * start address, or 0. Nothing is read until a page is touched.
+ */
+void mmap_init(void);
+uint32_t mmap_map_file(uint32_t dir, const char *filename, uint32_t flags, uint32_t *size);
+bool mmap_unmap(uint32_t dir, uint32_t addr);
+bool mmap_handle_fault(uint32_t addr, uint32_t err);
+
+/* Region bookkeeping for fork and exit; the pages follow the page tables */
+bool mmap_clone_space(uint32_t src, uint32_t dst);
+void mmap_release_space(uint32_t dir);
+
+#endif
@@ -2,35 +2,99 @@
 #define PROCESS_H
 
 #include "types.h"
+#include "idt.h"
+#include "io.h"
+#include "memory.h"
+#include "timer.h"
 
-#define MAX_PROCESSES    8
-#define PROCESS_STACK_SIZE 4096
+#define KSTACK_SIZE      0x4000     /* backed part of a kernel stack */
+#define KSTACK_SLOT      0x8000     /* per-task window, rest is guard */
+#define PID_LIMIT        (KSTACK_AREA / KSTACK_SLOT)   /* one stack window per PID */
+
+/*
+ * Priorities: 0 is the most urgent. Each level has its own time slice
+ * (prio_slices in process.c); the shell and compositor run at
+ * PRIO_INTERACTIVE, new tasks at PRIO_DEFAULT.
+ */
+#define PRIO_LEVELS      8
+#define PRIO_INTERACTIVE 1
+#define PRIO_DEFAULT     4
+#define PRIO_BATCH       6
 
 typedef enum {
     PROC_UNUSED = 0,
     PROC_READY,
     PROC_RUNNING,
+    PROC_BLOCKED,               /* off the run queues until woken */
     PROC_TERMINATED
 } process_state_t;
 
-typedef struct {
+struct process;
+
+/* Tasks blocked until someone, often an IRQ handler, calls wake_up() */
+typedef struct wait_queue {
+    struct process *head;
+    struct process *tail;
+} wait_queue_t;
+
+#define WAIT_QUEUE_INIT { NULL, NULL }
+
+typedef struct process {
     uint32_t pid;
     uint32_t esp;
-    uint32_t stack_base;
+    uint32_t page_dir;          /* physical address, loaded into CR3 */
     uint32_t kernel_stack;
     uint32_t kernel_stack_top;
     bool     is_user;
     process_state_t state;
     const char *name;
+
+    uint8_t  priority;
+    uint8_t  slice;             /* ticks left in this round */
+    uint8_t  queue;             /* run_arrays[] index while queued */
+    struct process *rq_next;    /* run or wait queue, or zombie list once terminated */
+    struct process *rq_prev;
+
+    wait_queue_t   *waiting_on; /* while blocked on a queue */
+    timer_t         sleep_timer; /* armed for a timed wait */
+    bool            timed_out;
+
+    void           *fpu_area;   /* FXSAVE image, allocated on first FPU use */
+    uint32_t        tlb_batch;  /* paging batch depth while switched out */
+
+    struct process *task_next;  /* every live task, in creation order */
+    struct process *task_prev;
 } process_t;
 
 void multitasking_init(void);
 int  process_create(void (*entry)(void), const char *name);
 int  process_create_user(void (*entry)(void), const char *name);
+int  process_fork(registers_t *regs);
 void schedule(void);
 void process_exit(void);
+int  process_set_priority(uint32_t pid, uint32_t priority);   /* old priority, or -1 */
+void process_preempt(void);   /* on IRQ exit: switch if a wakeup outranks us */
+
+/*
+ * Blocking. Call sleep_on*() with interrupts off after finding the
+ * condition false, so a wakeup can't slip in between; wait_event() does
+ * exactly that. Timeouts are in timer ticks, 0 meaning none. The return
+ * value says whether the task was woken rather than timed out.
+ */
+bool sleep_on_timeout(wait_queue_t *wq, uint32_t ticks);
+void sleep_on(wait_queue_t *wq);
+void sleep_ticks(uint32_t ticks);
+void wake_up(wait_queue_t *wq);   /* wakes every waiter */
+
+#define wait_event(wq, cond) do {                \
+        uint32_t wait_flags_ = irq_save();       \
+        while (!(cond)) sleep_on(wq);            \
+        irq_restore(wait_flags_);                \
+    } while (0)
 int  process_count(void);
-process_t *process_get_list(void);
+process_t *process_first(void);           /* walk on with ->task_next */
+process_t *process_find(uint32_t pid);     /* NULL if no such task */
+process_t *process_current(void);
 uint32_t process_current_pid(void);
 bool multitasking_enabled(void);
 
@@ -0,0 +1,45 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include "types.h"
+
+/*
+ * Object caches for fixed-size kernel objects. Each cache carves slabs
+ * of whole pages from the PMM into equal-sized objects, so allocation and
+ * free are O(1) list operations and objects of one type stay packed
+ * together instead of fragmenting the heap.
+ */
+
+#define KMEM_NAME_LEN 16
+
+struct kmem_slab;
+
+typedef struct kmem_cache {
+    char     name[KMEM_NAME_LEN];
+    uint32_t obj_size;          /* Requested object size */
+    uint32_t slot_size;         /* Object plus header, 4-byte aligned */
+    uint32_t objs_per_slab;
+    uint32_t slab_order;        /* 2^order pages per slab */
+    void   (*ctor)(void *obj);
+
+    struct kmem_slab *partial;  /* Some objects free */
+    struct kmem_slab *full;     /* No objects free */
+    struct kmem_slab *empty;    /* All objects free */
+
+    /* Statistics */
+    uint32_t slabs;
+    uint32_t active_objs;
+    uint32_t total_objs;
+    uint32_t allocs;
+    uint32_t frees;
+
+    struct kmem_cache *next;
+} kmem_cache_t;
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, void (*ctor)(void *));
+void *kmem_cache_alloc(kmem_cache_t *cache);
+void  kmem_cache_free(kmem_cache_t *cache, void *obj);
+uint32_t kmem_cache_shrink(kmem_cache_t *cache);   /* Release empty slabs; pages */
+kmem_cache_t *kmem_cache_list(void);
+
+#endif
@@ -4,6 +4,7 @@
 #include "types.h"
 
 void *memset(void *dest, int val, size_t count);
+void *memset32(uint32_t *dest, uint32_t val, size_t count);   /* count in dwords */
 void *memcpy(void *dest, const void *src, size_t count);
 int memcmp(const void *s1, const void *s2, size_t n);
 size_t strlen(const char *str);
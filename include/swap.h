@@ -0,0 +1,15 @@
+#ifndef SWAP_H
+#define SWAP_H
+
+#include "types.h"
+#include "memory.h"
+
+bool swap_init(void);
+uint32_t swap_reclaim(uint32_t pages);      /* pages actually freed */
+bool swap_fault_in(pte_t *pte);
+void swap_slot_dup(pte_t entry);            /* entry: a PG_SWAPPED PTE */
+void swap_slot_free(pte_t entry);
+uint32_t swap_get_total(void);              /* slots, one page each */
+uint32_t swap_get_used(void);
+
+#endif
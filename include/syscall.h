@@ -7,6 +7,12 @@
 #define SYS_WRITE   1
 #define SYS_GETKEY  2
 #define SYS_YIELD   3
+#define SYS_FORK    4
+#define SYS_MMAP    5
+#define SYS_MUNMAP  6
+#define SYS_SETPRIO 7   /* ebx = priority; returns the old one, or -1 */
+#define SYS_SLEEP   8   /* ebx = timer ticks */
+#define SYS_CLOCK   9   /* returns nanoseconds since boot in edx:eax */
 
 void syscall_init(void);
 
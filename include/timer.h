@@ -0,0 +1,42 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "types.h"
+
+/*
+ * Kernel timers on a hierarchical timing wheel, driven by the PIT tick.
+ * A timer is embedded in its owner and armed with an absolute expiry in
+ * ticks; arming, cancelling and firing are all O(1). Callbacks run in the
+ * timer interrupt with IRQs off, so they must be short and must not block:
+ * wake a task or queue an event and let it do the work.
+ */
+
+typedef void (*timer_fn_t)(void *arg);
+
+typedef struct timer {
+    struct timer  *next;
+    struct timer **pprev;       /* link pointing at us, NULL when idle */
+    uint32_t   expires;         /* absolute tick */
+    uint32_t   period;          /* re-arm interval, 0 for one-shot */
+    timer_fn_t fn;
+    void      *arg;
+} timer_t;
+
+#define TIMER_INIT(fn, arg) { NULL, NULL, 0, 0, (fn), (arg) }
+
+void timer_setup(timer_t *t, timer_fn_t fn, void *arg);
+void timer_add(timer_t *t, uint32_t expires);          /* re-arms if pending */
+void timer_add_periodic(timer_t *t, uint32_t period);  /* first fires in `period` */
+bool timer_cancel(timer_t *t);                         /* true if it was pending */
+
+static inline bool timer_pending(const timer_t *t) {
+    return t->pprev != NULL;
+}
+
+/* Fire everything due by `now`; called from the timer interrupt */
+void timer_run(uint32_t now);
+
+/* Ticks that may go unprocessed, at most `limit`, before one has work */
+uint32_t timer_idle_ticks(uint32_t limit);
+
+#endif
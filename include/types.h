@@ -7,6 +7,8 @@ typedef unsigned int       uint32_t;
 typedef char               int8_t;
 typedef short              int16_t;
 typedef int                int32_t;
+typedef unsigned long long uint64_t;
+typedef long long          int64_t;
 typedef unsigned int       size_t;
 
 #define NULL ((void *)0)
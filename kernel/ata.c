@@ -18,15 +18,22 @@
 #define ATA_REG_COMMAND    0x7
 
 #define ATA_STATUS_BSY     0x80
+#define ATA_STATUS_DF      0x20
 #define ATA_STATUS_DRQ     0x08
 #define ATA_STATUS_ERR     0x01
 
 #define ATA_CMD_READ       0x20
+#define ATA_CMD_WRITE      0x30
+#define ATA_CMD_FLUSH      0xE7
 #define ATA_CMD_IDENTIFY   0xEC
 
+#define ATA_CHUNK          8       /* sectors per command */
+
 static uint16_t ata_base = 0;
 static uint8_t  ata_drive_sel = 0;  /* 0xE0=master, 0xF0=slave */
 static bool     ata_present = false;
+static uint32_t ata_sectors = 0;     /* LBA28 capacity from IDENTIFY */
+static uint32_t ata_probe_sectors = 0;
 
 static void ata_wait_bsy_on(uint16_t base) {
     while (inb(base + ATA_REG_STATUS) & ATA_STATUS_BSY);
@@ -54,7 +61,9 @@ static bool ata_identify(uint16_t base, uint8_t drive_select) {
         if (status & ATA_STATUS_DRQ) break;
     }
 
-    for (int i = 0; i < 256; i++) inw(base + ATA_REG_DATA);
+    uint16_t id[256];
+    for (int i = 0; i < 256; i++) id[i] = inw(base + ATA_REG_DATA);
+    ata_probe_sectors = id[60] | ((uint32_t)id[61] << 16);
     return true;
 }
 
@@ -64,6 +73,7 @@ bool ata_init(void) {
         ata_base = ATA_PRIMARY_IO;
         ata_drive_sel = 0xF0;
         ata_present = true;
+        ata_sectors = ata_probe_sectors;
         return true;
     }
 
@@ -72,6 +82,7 @@ bool ata_init(void) {
         ata_base = ATA_SECONDARY_IO;
         ata_drive_sel = 0xE0;
         ata_present = true;
+        ata_sectors = ata_probe_sectors;
         return true;
     }
 
@@ -80,6 +91,7 @@ bool ata_init(void) {
         ata_base = ATA_SECONDARY_IO;
         ata_drive_sel = 0xF0;
         ata_present = true;
+        ata_sectors = ata_probe_sectors;
         return true;
     }
 
@@ -87,11 +99,23 @@ bool ata_init(void) {
     return false;
 }
 
-bool ata_read_sectors(uint32_t lba, uint8_t count, void *buffer) {
-    if (!ata_present || count == 0) return false;
+/* Wait out BSY, then check for an error or drive fault */
+static bool ata_status_ok(void) {
+    ata_wait_bsy_on(ata_base);
+    return !(inb(ata_base + ATA_REG_STATUS) & (ATA_STATUS_ERR | ATA_STATUS_DF));
+}
 
+/*
+ * One PIO command of at most ATA_CHUNK sectors. Page faults use the disk
+ * too, so IRQs stay off for the whole command to keep its register and
+ * data sequence whole; callers split longer transfers so interrupts are
+ * only ever held off for a few KB.
+ */
+static bool ata_pio(uint32_t lba, uint8_t count, void *buffer, bool write) {
     uint16_t *buf = (uint16_t *)buffer;
+    bool ok = true;
 
+    uint32_t flags = irq_save();
     ata_wait_bsy_on(ata_base);
 
     outb(ata_base + ATA_REG_DRIVE, ata_drive_sel | ((lba >> 24) & 0x0F));
@@ -99,24 +123,69 @@ bool ata_read_sectors(uint32_t lba, uint8_t count, void *buffer) {
     outb(ata_base + ATA_REG_LBA_LO, lba & 0xFF);
     outb(ata_base + ATA_REG_LBA_MID, (lba >> 8) & 0xFF);
     outb(ata_base + ATA_REG_LBA_HI, (lba >> 16) & 0xFF);
-    outb(ata_base + ATA_REG_COMMAND, ATA_CMD_READ);
+    outb(ata_base + ATA_REG_COMMAND, write ? ATA_CMD_WRITE : ATA_CMD_READ);
 
     for (int s = 0; s < count; s++) {
-        ata_wait_bsy_on(ata_base);
-
-        uint8_t status = inb(ata_base + ATA_REG_STATUS);
-        if (status & ATA_STATUS_ERR) return false;
+        if (!ata_status_ok()) {
+            ok = false;
+            break;
+        }
 
         while (!(inb(ata_base + ATA_REG_STATUS) & ATA_STATUS_DRQ));
 
         for (int i = 0; i < 256; i++) {
-            buf[s * 256 + i] = inw(ata_base + ATA_REG_DATA);
+            if (write) outw(ata_base + ATA_REG_DATA, buf[s * 256 + i]);
+            else buf[s * 256 + i] = inw(ata_base + ATA_REG_DATA);
         }
     }
 
+    /* A write only fails once the drive has taken the last sector */
+    if (ok && write) ok = ata_status_ok();
+
+    irq_restore(flags);
+    return ok;
+}
+
+static bool ata_transfer(uint32_t lba, uint8_t count, void *buffer, bool write) {
+    if (!ata_present || count == 0) return false;
+
+    uint8_t *buf = (uint8_t *)buffer;
+    while (count) {
+        uint8_t n = count < ATA_CHUNK ? count : ATA_CHUNK;
+        if (!ata_pio(lba, n, buf, write)) return false;
+        lba += n;
+        count -= n;
+        buf += n * 512;
+    }
     return true;
 }
 
+bool ata_read_sectors(uint32_t lba, uint8_t count, void *buffer) {
+    return ata_transfer(lba, count, buffer, false);
+}
+
+/* The data may still sit in the drive's cache; see ata_flush() */
+bool ata_write_sectors(uint32_t lba, uint8_t count, const void *buffer) {
+    return ata_transfer(lba, count, (void *)buffer, true);
+}
+
+/* Commit the drive's write cache; writes are not flushed one by one */
+bool ata_flush(void) {
+    if (!ata_present) return false;
+
+    uint32_t flags = irq_save();
+    ata_wait_bsy_on(ata_base);
+    outb(ata_base + ATA_REG_DRIVE, ata_drive_sel);
+    outb(ata_base + ATA_REG_COMMAND, ATA_CMD_FLUSH);
+    bool ok = ata_status_ok();
+    irq_restore(flags);
+    return ok;
+}
+
 bool ata_secondary_present(void) {
     return ata_present;
 }
+
+uint32_t ata_get_sectors(void) {
+    return ata_sectors;
+}
@@ -14,4 +14,15 @@ bool bootinfo_has_framebuffer(void) {
     return binfo->magic == BOOTINFO_MAGIC && binfo->vesa_mode == 1;
 }
 
+e820_entry_t *bootinfo_get_mmap(uint32_t *count) {
+    bootinfo_t *binfo = bootinfo_get();
+    if (!binfo || binfo->mmap_count == 0) {
+        *count = 0;
+        return NULL;
+    }
+    *count = binfo->mmap_count;
+    if (*count > BOOTINFO_MMAP_MAX) *count = BOOTINFO_MMAP_MAX;
+    return (e820_entry_t *)(uint32_t)BOOTINFO_MMAP_ADDR;
+}
+
 #pragma GCC diagnostic pop
@@ -0,0 +1,70 @@
+#include "clock.h"
+#include "io.h"
+#include "div64.h"
+
+#define PIT_FREQ     1193182
+#define PIT_CMD      0x43
+#define PIT_CH2      0x42
+#define PIT_GATE     0x61       /* bit 0: channel 2 gate, bit 5: its output */
+
+#define CALIBRATE_MS 50
+#define NS_SHIFT     24
+
+static uint64_t tsc_base = 0;
+static uint32_t tsc_khz = 0;
+static uint32_t ns_mult = 0;    /* ns per cycle, fixed point with NS_SHIFT bits */
+
+/*
+ * Count TSC cycles across a fixed PIT interval. Channel 2 is used because
+ * it can be polled through port 0x61 without an IRQ and leaves channel 0,
+ * the system tick, alone. The speaker stays off (bit 1 clear).
+ */
+static uint64_t calibrate_cycles(void) {
+    uint32_t count = PIT_FREQ / 1000 * CALIBRATE_MS;
+    uint8_t gate = inb(PIT_GATE) & ~0x03;
+
+    outb(PIT_GATE, gate);
+    outb(PIT_CMD, 0xB0);        /* channel 2, lo/hi byte, mode 0 */
+    outb(PIT_CH2, (uint8_t)(count & 0xFF));
+    outb(PIT_CH2, (uint8_t)((count >> 8) & 0xFF));
+
+    uint32_t flags = irq_save();
+    outb(PIT_GATE, gate | 0x01);
+    uint64_t start = rdtsc();
+    while (!(inb(PIT_GATE) & 0x20)) ;
+    uint64_t cycles = rdtsc() - start;
+    irq_restore(flags);
+
+    outb(PIT_GATE, gate);
+    return cycles;
+}
+
+void clock_init(void) {
+    /* Best of three: an SMI or a slow port read only ever adds cycles */
+    uint64_t cycles = calibrate_cycles();
+    for (int i = 0; i < 2; i++) {
+        uint64_t c = calibrate_cycles();
+        if (c < cycles) cycles = c;
+    }
+
+    tsc_khz = (uint32_t)div64_u32(cycles, CALIBRATE_MS);
+    if (!tsc_khz) tsc_khz = 1;
+    ns_mult = (uint32_t)div64_u32((uint64_t)1000000 << NS_SHIFT, tsc_khz);
+    tsc_base = rdtsc();
+}
+
+uint32_t clock_tsc_khz(void) {
+    return tsc_khz;
+}
+
+uint64_t clock_cycles(void) {
+    return rdtsc() - tsc_base;
+}
+
+/* cycles * ns_mult >> NS_SHIFT, split so no product overflows 64 bits */
+uint64_t clock_ns(void) {
+    uint64_t cycles = clock_cycles();
+    uint64_t lo = (uint64_t)(uint32_t)cycles * ns_mult;
+    uint64_t hi = (uint64_t)(uint32_t)(cycles >> 32) * ns_mult;
+    return (lo >> NS_SHIFT) + (hi << (32 - NS_SHIFT));
+}
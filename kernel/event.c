@@ -1,11 +1,13 @@
 #include "event.h"
 #include "string.h"
+#include "process.h"
 
 #define EVENT_QUEUE_SIZE 256
 
 static event_t event_queue[EVENT_QUEUE_SIZE];
 static volatile int eq_head = 0;
 static volatile int eq_tail = 0;
+static wait_queue_t event_wq = WAIT_QUEUE_INIT;
 
 void event_init(void) {
     eq_head = 0;
@@ -18,6 +20,7 @@ void event_push(event_t *e) {
     if (next == eq_tail) return;
     event_queue[eq_head] = *e;
     eq_head = next;
+    wake_up(&event_wq);
 }
 
 bool event_poll(event_t *e) {
@@ -27,6 +30,13 @@ bool event_poll(event_t *e) {
     return true;
 }
 
+/* Block until an event is queued or `ticks` pass (0: no timeout) */
+void event_wait(uint32_t ticks) {
+    uint32_t flags = irq_save();
+    if (eq_head == eq_tail) sleep_on_timeout(&event_wq, ticks);
+    irq_restore(flags);
+}
+
 void event_push_key(char key) {
     event_t e;
     e.type = EVENT_KEY_PRESS;
@@ -51,10 +51,10 @@ static uint16_t root_entry_count;
 static uint8_t  sectors_per_cluster;
 static uint16_t bytes_per_sector;
 static uint16_t fat_size;
+static uint32_t volume_sectors;
 
 /* Sector buffer */
 static uint8_t sector_buf[512];
-static uint8_t fat_table_buf[512];
 
 static void format_83_name(const fat16_dirent_t *entry, char *out) {
     int i, j = 0;
@@ -112,6 +112,7 @@ bool fat_init(void) {
     sectors_per_cluster = bpb->sectors_per_cluster;
     root_entry_count    = bpb->root_entry_count;
     fat_size            = bpb->fat_size_16;
+    volume_sectors      = bpb->total_sectors_16 ? bpb->total_sectors_16 : bpb->total_sectors_32;
 
     fat_start_lba  = bpb->reserved_sectors;
     root_dir_lba   = fat_start_lba + (bpb->num_fats * fat_size);
@@ -127,6 +128,11 @@ bool fat_is_mounted(void) {
     return mounted;
 }
 
+/* Sectors the volume claims; the disk beyond them is free for other use */
+uint32_t fat_volume_sectors(void) {
+    return mounted ? volume_sectors : 0;
+}
+
 int fat_list_root(fat_dir_entry_t *entries, int max_entries) {
     if (!mounted) return -1;
 
@@ -156,7 +162,10 @@ int fat_list_root(fat_dir_entry_t *entries, int max_entries) {
     return count;
 }
 
+/* The FAT sector goes into a stack buffer, leaving sector_buf to the caller */
 static uint16_t fat_next_cluster(uint16_t cluster) {
+    uint8_t fat_table_buf[512];
+
     /* Each FAT16 entry is 2 bytes */
     uint32_t fat_offset = cluster * 2;
     uint32_t fat_sector = fat_start_lba + (fat_offset / 512);
@@ -172,46 +181,49 @@ static uint32_t cluster_to_lba(uint16_t cluster) {
     return data_start_lba + (cluster - 2) * sectors_per_cluster;
 }
 
-int fat_read_file(const char *filename, void *buffer, uint32_t max_size) {
-    if (!mounted) return -1;
+bool fat_lookup(const char *filename, fat_dir_entry_t *out) {
+    if (!mounted) return false;
 
-    /* Find file in root directory */
     char name83[11];
     to_83_name(filename, name83);
 
     uint32_t root_sectors = (root_entry_count * 32 + 511) / 512;
-    uint16_t first_cluster = 0;
-    uint32_t file_size = 0;
-    bool found = false;
 
     for (uint32_t s = 0; s < root_sectors; s++) {
-        if (!ata_read_sectors(root_dir_lba + s, 1, sector_buf)) return -1;
+        if (!ata_read_sectors(root_dir_lba + s, 1, sector_buf)) return false;
 
         fat16_dirent_t *de = (fat16_dirent_t *)sector_buf;
         int entries_per_sector = 512 / sizeof(fat16_dirent_t);
 
         for (int i = 0; i < entries_per_sector; i++) {
-            if (de[i].name[0] == 0x00) return -1;         /* End of directory */
+            if (de[i].name[0] == 0x00) return false;      /* End of directory */
             if ((uint8_t)de[i].name[0] == 0xE5) continue;  /* Deleted */
             if (de[i].attr & 0x08) continue;                /* Volume label */
             if (de[i].attr & 0x0F) continue;                /* LFN */
 
             if (memcmp(de[i].name, name83, 8) == 0 && memcmp(de[i].ext, name83 + 8, 3) == 0) {
-                first_cluster = de[i].first_cluster_lo;
-                file_size = de[i].file_size;
-                found = true;
-                break;
+                format_83_name(&de[i], out->name);
+                out->size = de[i].file_size;
+                out->first_cluster = de[i].first_cluster_lo;
+                out->attr = de[i].attr;
+                return true;
             }
         }
-        if (found) break;
     }
 
-    if (!found) return -1;
+    return false;
+}
+
+int fat_read_file(const char *filename, void *buffer, uint32_t max_size) {
+    fat_dir_entry_t entry;
+    if (!fat_lookup(filename, &entry)) return -1;
+
+    uint32_t file_size = entry.size;
 
     /* Read file data following the cluster chain */
     uint8_t *buf = (uint8_t *)buffer;
     uint32_t bytes_read = 0;
-    uint16_t cluster = first_cluster;
+    uint16_t cluster = entry.first_cluster;
 
     while (cluster >= 2 && cluster < 0xFFF8 && bytes_read < file_size) {
         uint32_t lba = cluster_to_lba(cluster);
@@ -234,3 +246,81 @@ int fat_read_file(const char *filename, void *buffer, uint32_t max_size) {
 
     return bytes_read;
 }
+
+/*
+ * Resolve a cluster chain into runs of consecutive clusters, so a mapped
+ * file walks its chain once instead of on every page it faults in. The
+ * FAT sector in hand is reused while the chain stays inside it. With runs
+ * NULL the runs are only counted. Returns the number of runs, or -1 if
+ * the FAT can't be read.
+ */
+int fat_chain_runs(uint16_t first_cluster, fat_run_t *runs, int max_runs) {
+    if (!mounted) return -1;
+
+    uint8_t fat_buf[512];
+    uint32_t buf_sector = 0;
+    int count = 0;
+    uint16_t run_end = 0;       /* cluster that would extend the last run */
+    uint16_t cluster = first_cluster;
+
+    /* A chain can't be longer than the FAT; stop on a corrupt, looping one */
+    for (uint32_t hops = 0; cluster >= 2 && cluster < 0xFFF8 && hops < 0xFFF8; hops++) {
+        if (count && cluster == run_end) {
+            if (runs) runs[count - 1].count++;
+        } else {
+            if (runs && count == max_runs) break;
+            if (runs) {
+                runs[count].cluster = cluster;
+                runs[count].count = 1;
+            }
+            count++;
+        }
+        run_end = cluster + 1;
+
+        uint32_t sector = fat_start_lba + cluster * 2 / 512;
+        if (sector != buf_sector) {
+            if (!ata_read_sectors(sector, 1, fat_buf)) return -1;
+            buf_sector = sector;
+        }
+        cluster = *(uint16_t *)&fat_buf[cluster * 2 % 512];
+    }
+
+    return count;
+}
+
+/*
+ * Read len bytes (a multiple of 512) from sector-aligned `offset` of a file
+ * given by its cluster runs, straight into buf and one ATA command per run
+ * (up to the 255-sector command limit). Stops early at the end of the runs.
+ */
+int fat_read_runs(const fat_run_t *runs, int run_count, uint32_t offset, void *buf, uint32_t len) {
+    if (!mounted) return -1;
+
+    uint32_t sector = offset / 512;
+    uint8_t *dst = (uint8_t *)buf;
+    uint32_t done = 0;
+
+    for (int i = 0; i < run_count && done < len; i++) {
+        uint32_t run_sectors = runs[i].count * sectors_per_cluster;
+        if (sector >= run_sectors) {
+            sector -= run_sectors;
+            continue;
+        }
+
+        uint32_t lba = cluster_to_lba(runs[i].cluster) + sector;
+        uint32_t left = run_sectors - sector;
+        while (left && done < len) {
+            uint32_t n = (len - done) / 512;
+            if (n > left) n = left;
+            if (n > 255) n = 255;
+
+            if (!ata_read_sectors(lba, n, dst + done)) return done;
+            lba += n;
+            left -= n;
+            done += n * 512;
+        }
+        sector = 0;
+    }
+
+    return done;
+}
@@ -22,7 +22,10 @@ bool fb_init(void) {
     uint32_t fb_size = fb_pitch * fb_height;
     fb_size = (fb_size + 4095) & ~4095;
 
-    paging_map_region(fb_phys, fb_phys, fb_size, 0x03);
+    /* Write-combining lets full-frame blits burst instead of stalling per store */
+    if (!paging_map_large(fb_phys, fb_phys, fb_size, 0x03, PAGE_CACHE_WC)) {
+        paging_map_region(fb_phys, fb_phys, fb_size, 0x03, PAGE_CACHE_WC);
+    }
 
     fb_ptr = (uint32_t *)fb_phys;
     fb_active = true;
@@ -51,9 +54,7 @@ void fb_fill_rect(uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t color
         uint32_t *line = (uint32_t *)((uint8_t *)fb_ptr + row * fb_pitch);
         uint32_t x_end = x + w;
         if (x_end > fb_width) x_end = fb_width;
-        for (uint32_t col = x; col < x_end; col++) {
-            line[col] = color;
-        }
+        if (x < x_end) memset32(&line[x], color, x_end - x);
     }
 }
 
@@ -92,9 +93,7 @@ void fb_draw_line(int x0, int y0, int x1, int y1, uint32_t color) {
 void fb_clear(uint32_t color) {
     for (uint32_t y = 0; y < fb_height; y++) {
         uint32_t *line = (uint32_t *)((uint8_t *)fb_ptr + y * fb_pitch);
-        for (uint32_t x = 0; x < fb_width; x++) {
-            line[x] = color;
-        }
+        memset32(line, color, fb_width);
     }
 }
 
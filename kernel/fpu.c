@@ -0,0 +1,120 @@
+#include "fpu.h"
+#include "process.h"
+#include "slab.h"
+#include "string.h"
+
+#define CR0_MP         (1 << 1)
+#define CR0_EM         (1 << 2)
+#define CR0_TS         (1 << 3)
+#define CR0_NE         (1 << 5)
+#define CR4_OSFXSR     (1 << 9)
+#define CR4_OSXMMEXCPT (1 << 10)
+
+#define CPUID_FXSR     (1 << 24)
+#define CPUID_SSE      (1 << 25)
+
+/* FXSAVE wants 16-byte alignment; slab objects are 4-aligned, so pad */
+#define FPU_STATE_SIZE 512
+#define FPU_ALIGN      16
+
+static kmem_cache_t *fpu_cache = NULL;
+static bool fpu_enabled = false;
+static process_t *fpu_owner = NULL;     /* whose state is in the registers */
+static uint8_t fpu_initial[FPU_STATE_SIZE] __attribute__((aligned(FPU_ALIGN)));
+
+static inline void clts(void) {
+    __asm__ volatile("clts");
+}
+
+static inline void stts(void) {
+    uint32_t cr0;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+    __asm__ volatile("mov %0, %%cr0" :: "r"(cr0 | CR0_TS));
+}
+
+static inline void fxsave(void *area) {
+    __asm__ volatile("fxsave (%0)" :: "r"(area) : "memory");
+}
+
+static inline void fxrstor(const void *area) {
+    __asm__ volatile("fxrstor (%0)" :: "r"(area) : "memory");
+}
+
+static void *fpu_state(process_t *p) {
+    return (void *)(((uint32_t)p->fpu_area + FPU_ALIGN - 1) & ~(FPU_ALIGN - 1));
+}
+
+/* Allocate p's FXSAVE area, initialised to the clean post-fninit state */
+static bool fpu_alloc(process_t *p) {
+    p->fpu_area = kmem_cache_alloc(fpu_cache);
+    if (!p->fpu_area) return false;
+    memcpy(fpu_state(p), fpu_initial, FPU_STATE_SIZE);
+    return true;
+}
+
+bool fpu_init(void) {
+    uint32_t a, b, c, d;
+    __asm__ volatile("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(1));
+    if (!(d & CPUID_FXSR) || !(d & CPUID_SSE)) return false;
+
+    fpu_cache = kmem_cache_create("fpu", FPU_STATE_SIZE + FPU_ALIGN, NULL);
+    if (!fpu_cache) return false;
+
+    uint32_t cr0, cr4;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+    __asm__ volatile("mov %0, %%cr0" :: "r"((cr0 & ~(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE));
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    __asm__ volatile("mov %0, %%cr4" :: "r"(cr4 | CR4_OSFXSR | CR4_OSXMMEXCPT));
+
+    /* Snapshot a clean state (MXCSR at its reset value) for new tasks */
+    uint32_t mxcsr = 0x1F80;
+    __asm__ volatile("fninit; ldmxcsr %0" :: "m"(mxcsr));
+    fxsave(fpu_initial);
+
+    fpu_enabled = true;
+    stts();
+    return true;
+}
+
+void fpu_switch(process_t *next) {
+    if (!fpu_enabled) return;
+    if (next == fpu_owner) clts();
+    else stts();
+}
+
+bool fpu_trap(void) {
+    if (!fpu_enabled) return false;
+
+    clts();
+    process_t *p = process_current();
+    if (!p || p == fpu_owner) return true;
+
+    if (!p->fpu_area && !fpu_alloc(p)) {
+        stts();
+        return false;
+    }
+
+    if (fpu_owner) fxsave(fpu_state(fpu_owner));
+    fxrstor(fpu_state(p));
+    fpu_owner = p;
+    return true;
+}
+
+/* The child starts with a copy of the parent's FPU state, if it has one */
+bool fpu_fork(process_t *parent, process_t *child) {
+    if (!parent->fpu_area) return true;
+    if (!fpu_alloc(child)) return false;
+
+    if (parent == fpu_owner) {
+        clts();
+        fxsave(fpu_state(parent));
+    }
+    memcpy(fpu_state(child), fpu_state(parent), FPU_STATE_SIZE);
+    return true;
+}
+
+void fpu_release(process_t *p) {
+    if (fpu_owner == p) fpu_owner = NULL;
+    if (p->fpu_area) kmem_cache_free(fpu_cache, p->fpu_area);
+    p->fpu_area = NULL;
+}
@@ -4,6 +4,10 @@
 #include "vga.h"
 #include "syscall.h"
 #include "process.h"
+#include "memory.h"
+#include "mmap.h"
+#include "timer.h"
+#include "fpu.h"
 
 struct idt_entry {
     uint16_t base_low;
@@ -97,12 +101,47 @@ static void pic_remap(void) {
 #define PIT_CH0  0x40
 #define PIT_FREQ 1193180
 
+#define PIT_PERIODIC 0x34       /* channel 0, lo/hi byte, mode 2 (rate generator) */
+#define PIT_ONESHOT  0x30       /* channel 0, lo/hi byte, mode 0 (terminal count) */
+#define PIT_LATCH    0x00       /* latch channel 0's count */
+#define PIT_STATUS   0xE2       /* read back channel 0's status */
+#define PIT_MAX      0xFFFF
+
 static volatile uint32_t timer_ticks = 0;
 static void (*scheduler_fn)(void) = NULL;
 
+/*
+ * Tickless idle. Normally the PIT runs periodically, one IRQ per tick.
+ * When the idle task is about to halt, it rearms the PIT as a one-shot
+ * that covers every tick up to the next timer due, so nothing interrupts
+ * an idle CPU for nothing. nohz_ticks is how many ticks that one-shot
+ * stands for. The 16-bit counter caps one sleep at about 55ms.
+ */
+static uint32_t pit_divisor = 0;
+static uint32_t nohz_ticks = 0;
+
+static void pit_program(uint8_t mode, uint32_t count) {
+    outb(PIT_CMD, mode);
+    outb(PIT_CH0, (uint8_t)(count & 0xFF));
+    outb(PIT_CH0, (uint8_t)((count >> 8) & 0xFF));
+}
+
+static uint32_t pit_read_count(void) {
+    outb(PIT_CMD, PIT_LATCH);
+    uint32_t count = inb(PIT_CH0);
+    return count | (uint32_t)inb(PIT_CH0) << 8;
+}
+
 static void timer_handler(registers_t *regs) {
     (void)regs;
-    timer_ticks++;
+    if (nohz_ticks) {
+        timer_ticks += nohz_ticks;
+        nohz_ticks = 0;
+        pit_program(PIT_PERIODIC, pit_divisor);
+    } else {
+        timer_ticks++;
+    }
+    timer_run(timer_ticks);
 
     if (scheduler_fn) {
         scheduler_fn();
@@ -110,13 +149,46 @@ static void timer_handler(registers_t *regs) {
 }
 
 void pit_init(uint32_t frequency) {
-    uint32_t divisor = PIT_FREQ / frequency;
-    outb(PIT_CMD, 0x34);
-    outb(PIT_CH0, (uint8_t)(divisor & 0xFF));
-    outb(PIT_CH0, (uint8_t)((divisor >> 8) & 0xFF));
+    pit_divisor = PIT_FREQ / frequency;
+    pit_program(PIT_PERIODIC, pit_divisor);
     irq_install_handler(0, timer_handler);
 }
 
+/*
+ * Called with IRQs off right before halting. The one-shot starts from the
+ * count left in the current period, so ticks stay in phase with the
+ * periodic ones. Skipped if a tick IRQ is already pending.
+ */
+void timer_nohz_enter(void) {
+    if (!pit_divisor || nohz_ticks) return;
+
+    outb(PIC1_CMD, 0x0A);
+    if (inb(PIC1_CMD) & 0x01) return;
+
+    uint32_t left = pit_read_count();
+    uint32_t n = timer_idle_ticks(1 + (PIT_MAX - left) / pit_divisor);
+    if (n < 2) return;
+
+    nohz_ticks = n;
+    pit_program(PIT_ONESHOT, left + (n - 1) * pit_divisor);
+}
+
+/*
+ * Another IRQ woke us early: account for the whole ticks that passed and
+ * finish the one in progress with a short one-shot, which switches back
+ * to periodic mode when it fires. If the one-shot has already run out,
+ * its IRQ is pending and will do the accounting itself.
+ */
+static void timer_nohz_exit(void) {
+    outb(PIT_CMD, PIT_STATUS);
+    if (inb(PIT_CH0) & 0x80) return;
+
+    uint32_t elapsed = nohz_ticks * pit_divisor - pit_read_count();
+    timer_ticks += elapsed / pit_divisor;
+    nohz_ticks = 1;
+    pit_program(PIT_ONESHOT, pit_divisor - elapsed % pit_divisor);
+}
+
 uint32_t timer_get_ticks(void) {
     return timer_ticks;
 }
@@ -129,12 +201,20 @@ void isr_handler(registers_t *regs) {
     if (regs->int_no == 128) {
         syscall_handler(regs);
         return;
+    } else if (regs->int_no == 7 && fpu_trap()) {
+        return;
+    } else if (regs->int_no == 14 && (paging_handle_fault(read_cr2(), regs->err_code) ||
+                                      mmap_handle_fault(read_cr2(), regs->err_code))) {
+        return;
     } else if (regs->int_no < 32) {
         terminal_print_colored("\n*** EXCEPTION: ", VGA_WHITE, VGA_RED);
         terminal_print_colored(exception_messages[regs->int_no], VGA_WHITE, VGA_RED);
         terminal_print_colored(" ***\n", VGA_WHITE, VGA_RED);
         terminal_printf("  INT=%d  ERR=0x%x  EIP=0x%x  CS=0x%x\n",
             regs->int_no, regs->err_code, regs->eip, regs->cs);
+        if (regs->int_no == 14) {
+            terminal_printf("  CR2=0x%x\n", read_cr2());
+        }
 
         if ((regs->cs & 0x03) == 3) {
             terminal_print_colored("  Killing user process.\n", VGA_YELLOW, VGA_BLACK);
@@ -152,9 +232,11 @@ void isr_handler(registers_t *regs) {
         }
         outb(PIC1_CMD, 0x20);
 
+        if (irq && nohz_ticks > 1) timer_nohz_exit();
         if (irq_handlers[irq]) {
             irq_handlers[irq](regs);
         }
+        process_preempt();
     }
 }
 
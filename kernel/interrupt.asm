@@ -104,8 +104,12 @@ ISR_NOERRCODE 128   ; Syscall gate
 ; ============================================================
 ; Common ISR stub
 ; Saves all registers, calls C handler, restores and irets.
+; isr_return is also entered directly by forked tasks, with ESP
+; pointing at a copied registers_t frame.
 ; ============================================================
 
+global isr_return
+
 isr_common_stub:
     pusha                   ; Push EAX, ECX, EDX, EBX, ESP, EBP, ESI, EDI
 
@@ -117,11 +121,13 @@ isr_common_stub:
     mov es, ax
     mov fs, ax
     mov gs, ax
+    cld                     ; C code (rep movs/stos) assumes DF=0; iret restores it
 
     push esp                ; Push pointer to registers_t struct
     call isr_handler        ; Call C handler
     add esp, 4              ; Clean up pushed pointer
 
+isr_return:
     pop eax                 ; Restore original data segment
     mov ds, ax
     mov es, ax
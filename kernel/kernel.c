@@ -15,6 +15,10 @@
 #include "event.h"
 #include "wm.h"
 #include "syscall.h"
+#include "swap.h"
+#include "mmap.h"
+#include "clock.h"
+#include "fpu.h"
 
 static void ok(const char *msg) {
     terminal_print("  [");
@@ -26,7 +30,7 @@ static void ok(const char *msg) {
 
 void main(void) {
     gdt_init();
-    pmm_init(16384);
+    pmm_init();
     paging_init();
     fb_init();
 
@@ -46,6 +50,11 @@ void main(void) {
     pit_init(100);
     ok("PIT timer at 100 Hz");
 
+    clock_init();
+    terminal_print("  [");
+    terminal_print_colored("OK", VGA_LIGHT_GREEN, VGA_BLACK);
+    terminal_printf("] TSC clock at %d MHz\n", clock_tsc_khz() / 1000);
+
     keyboard_init();
     ok("PS/2 keyboard driver");
 
@@ -57,7 +66,11 @@ void main(void) {
     terminal_printf("] Physical memory: %d pages (%d KB free)\n",
         pmm_get_total_pages(), pmm_get_free_pages() * 4);
 
-    ok("Paging enabled (identity-mapped 16 MB)");
+    terminal_print("  [");
+    terminal_print_colored("OK", VGA_LIGHT_GREEN, VGA_BLACK);
+    terminal_printf("] PAE paging enabled (identity-mapped %d MB, NX %s)\n",
+        paging_get_identity_size() / (1024 * 1024),
+        paging_has_nx() ? "on" : "off");
 
     if (fb_is_active()) {
         terminal_printf("  [");
@@ -70,8 +83,17 @@ void main(void) {
     terminal_print_colored("OK", VGA_LIGHT_GREEN, VGA_BLACK);
     terminal_printf("] Heap: %d KB available\n", heap_get_free() / 1024);
 
+    if (fpu_init()) ok("FPU/SSE enabled, lazily switched");
+
     if (ata_init() && fat_init()) {
         ok("FAT16 filesystem mounted");
+        mmap_init();
+
+        if (swap_init()) {
+            terminal_print("  [");
+            terminal_print_colored("OK", VGA_LIGHT_GREEN, VGA_BLACK);
+            terminal_printf("] Swap: %d KB after the FAT volume\n", swap_get_total() * 4);
+        }
     } else {
         terminal_print("  [");
         terminal_print_colored("--", VGA_YELLOW, VGA_BLACK);
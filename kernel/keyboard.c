@@ -3,6 +3,7 @@
 #include "io.h"
 #include "vga.h"
 #include "event.h"
+#include "process.h"
 
 #define KB_DATA_PORT 0x60
 #define KB_BUFFER_SIZE 128
@@ -11,6 +12,8 @@ static char kb_buffer[KB_BUFFER_SIZE];
 static volatile int kb_head = 0;
 static volatile int kb_tail = 0;
 
+static wait_queue_t kb_wait = WAIT_QUEUE_INIT;
+
 static bool shift_held = false;
 static bool caps_lock  = false;
 
@@ -78,6 +81,7 @@ static void keyboard_handler(registers_t *regs) {
     if (c != 0) {
         kb_buffer_push(c);
         event_push_key(c);
+        wake_up(&kb_wait);
     }
 }
 
@@ -97,8 +101,6 @@ char keyboard_read(void) {
 }
 
 char keyboard_getchar(void) {
-    while (!keyboard_has_input()) {
-        hlt();
-    }
+    wait_event(&kb_wait, keyboard_has_input());
     return keyboard_read();
 }
@@ -1,58 +1,504 @@
 #include "memory.h"
 #include "string.h"
 #include "vga.h"
+#include "bootinfo.h"
+#include "io.h"
+#include "swap.h"
 
-#define PAGE_SIZE       4096
 #define PMM_START       0x100000   /* Start managing from 1MB */
-#define PMM_BITMAP_ADDR 0x20000    /* Bitmap stored at 128KB */
-#define PMM_MAX_PAGES   4096       /* 16MB / 4KB = 4096 pages */
+#define PMM_FALLBACK_TOP 0x1000000 /* Assume 16MB if the BIOS gave no map */
+#define PMM_NONE        0xFFFFFFFF
+#define PMM_PHYS_LIMIT  0x400000000ULL /* 16GB tracked: a 48MB frame table */
+#define DIRECT_FRAMES   (PHYS_DIRECT_LIMIT / PAGE_SIZE)
 
-static uint32_t *pmm_bitmap = (uint32_t *)PMM_BITMAP_ADDR;
-static uint32_t  pmm_total_pages = 0;
-static uint32_t  pmm_used_pages  = 0;
+/*
+ * Buddy allocator. Every physical frame has a descriptor; the head frame of
+ * each free block carries its order and sits on the free list for that
+ * order. Frame numbers are physical (phys >> 12), so a block of order n is
+ * always 2^n-page aligned in physical memory and its buddy is pfn ^ (1 << n).
+ */
+#define FRAME_FREE      0x01       /* head of a free block */
+#define FRAME_RESERVED  0x02       /* never handed out (holes, frame table) */
 
-static void pmm_set_bit(uint32_t page) {
-    pmm_bitmap[page / 32] |= (1 << (page % 32));
+typedef struct {
+    uint32_t next;
+    uint32_t prev;
+    uint8_t  order;
+    uint8_t  flags;
+    uint16_t refcount;
+} page_frame_t;
+
+/*
+ * Each zone runs its own buddy lists. ZONE_DMA_LIMIT and PHYS_DIRECT_LIMIT
+ * are multiples of the largest block, so no block or buddy pair ever
+ * straddles two zones.
+ */
+typedef struct {
+    uint32_t free_head[PMM_MAX_ORDER + 1];
+    uint32_t free_count[PMM_MAX_ORDER + 1];
+    uint32_t total_pages;
+    uint32_t free_pages;
+} pmm_zone_data_t;
+
+static page_frame_t *pmm_frames = NULL;
+static pmm_zone_data_t pmm_zones[ZONE_COUNT];
+static uint32_t pmm_frame_count = 0;
+static uint32_t pmm_mem_top = 0;      /* end of RAM in the direct map */
+static uint32_t pmm_total_pages = 0;
+static uint32_t pmm_used_pages  = 0;
+static uint32_t pmm_peak_pages  = 0;
+
+static pmm_zone_data_t *pmm_zone_of(uint32_t pfn) {
+    if (pfn < ZONE_DMA_LIMIT / PAGE_SIZE) return &pmm_zones[ZONE_DMA];
+    return &pmm_zones[pfn < DIRECT_FRAMES ? ZONE_NORMAL : ZONE_HIGH];
 }
 
-static void pmm_clear_bit(uint32_t page) {
-    pmm_bitmap[page / 32] &= ~(1 << (page % 32));
+static void pmm_list_push(uint32_t pfn, uint32_t order) {
+    pmm_zone_data_t *z = pmm_zone_of(pfn);
+    page_frame_t *f = &pmm_frames[pfn];
+    f->order = order;
+    f->flags = FRAME_FREE;
+    f->prev = PMM_NONE;
+    f->next = z->free_head[order];
+    if (f->next != PMM_NONE) pmm_frames[f->next].prev = pfn;
+    z->free_head[order] = pfn;
+    z->free_count[order]++;
+    z->free_pages += 1u << order;
 }
 
-static bool pmm_test_bit(uint32_t page) {
-    return pmm_bitmap[page / 32] & (1 << (page % 32));
+static void pmm_list_remove(uint32_t pfn) {
+    pmm_zone_data_t *z = pmm_zone_of(pfn);
+    page_frame_t *f = &pmm_frames[pfn];
+    if (f->prev != PMM_NONE) pmm_frames[f->prev].next = f->next;
+    else z->free_head[f->order] = f->next;
+    if (f->next != PMM_NONE) pmm_frames[f->next].prev = f->prev;
+    z->free_count[f->order]--;
+    z->free_pages -= 1u << f->order;
+    f->flags = 0;
 }
 
-void pmm_init(uint32_t mem_size_kb) {
-    pmm_total_pages = (mem_size_kb * 1024 - PMM_START) / PAGE_SIZE;
-    if (pmm_total_pages > PMM_MAX_PAGES) pmm_total_pages = PMM_MAX_PAGES;
+/* Return a block to the free lists, merging with free buddies */
+static void pmm_free_block(uint32_t pfn, uint32_t order) {
+    while (order < PMM_MAX_ORDER) {
+        uint32_t buddy = pfn ^ (1u << order);
+        if (buddy >= pmm_frame_count) break;
+        if (pmm_frames[buddy].flags != FRAME_FREE || pmm_frames[buddy].order != order) break;
+        pmm_list_remove(buddy);
+        pfn &= ~(1u << order);
+        order++;
+    }
+    pmm_list_push(pfn, order);
+}
 
-    uint32_t bitmap_size = pmm_total_pages / 8;
-    if (pmm_total_pages % 8) bitmap_size++;
+/* Hand [start, end) to the allocator as the largest aligned blocks that fit */
+static void pmm_release_range(uint32_t start, uint32_t end) {
+    if (end > pmm_frame_count) end = pmm_frame_count;
+    while (start < end) {
+        uint32_t order = PMM_MAX_ORDER;
+        while (order > 0 &&
+               ((start & ((1u << order) - 1)) || start + (1u << order) > end)) {
+            order--;
+        }
+        pmm_free_block(start, order);
+        pmm_total_pages += 1u << order;
+        pmm_zone_of(start)->total_pages += 1u << order;
+        start += 1u << order;
+    }
+}
 
-    memset(pmm_bitmap, 0, bitmap_size);
-    pmm_used_pages = 0;
+/* Clip an E820 entry to page-aligned frame numbers the PMM can track */
+static bool e820_frames(const e820_entry_t *e, uint32_t *start, uint32_t *end) {
+    uint64_t base = e->base;
+    uint64_t top  = e->base + e->length;
+    if (base >= PMM_PHYS_LIMIT || top <= base) return false;
+    if (top > PMM_PHYS_LIMIT) top = PMM_PHYS_LIMIT;
+    *start = (uint32_t)((base + PAGE_SIZE - 1) >> 12);
+    *end   = (uint32_t)(top >> 12);
+    return *start < *end;
 }
 
-void *pmm_alloc_page(void) {
-    for (uint32_t i = 0; i < pmm_total_pages; i++) {
-        if (!pmm_test_bit(i)) {
-            pmm_set_bit(i);
-            pmm_used_pages++;
-            return (void *)(PMM_START + i * PAGE_SIZE);
+static e820_entry_t *pmm_mmap;
+static uint32_t pmm_mmap_count;
+static uint32_t pmm_holes[2][2];   /* frame table, framebuffer (frames) */
+
+/*
+ * Release [start, end) minus anything that must stay reserved: the fixed
+ * holes above, every non-usable E820 range, and usable entries already
+ * released (E820 entries may overlap). Entry `self` is the one being added.
+ */
+static void pmm_release_avoiding(uint32_t start, uint32_t end, uint32_t self) {
+    uint32_t hs = 0, he = 0;
+    bool hit = false;
+
+    for (int i = 0; i < 2 && !hit; i++) {
+        hs = pmm_holes[i][0];
+        he = pmm_holes[i][1];
+        hit = hs < end && he > start;
+    }
+    for (uint32_t i = 0; i < pmm_mmap_count && !hit; i++) {
+        if (pmm_mmap[i].type == E820_USABLE && i >= self) continue;
+        if (!e820_frames(&pmm_mmap[i], &hs, &he)) continue;
+        hit = hs < end && he > start;
+    }
+
+    if (!hit) {
+        pmm_release_range(start, end);
+        return;
+    }
+    if (hs > start) pmm_release_avoiding(start, hs, self);
+    if (he < end)   pmm_release_avoiding(he, end, self);
+}
+
+/*
+ * Find room for the frame table in usable RAM inside the direct map, above
+ * the DMA zone if possible.
+ */
+static uint32_t pmm_place_frame_table(uint32_t bytes) {
+    static const uint32_t floors[2] = { ZONE_DMA_LIMIT / PAGE_SIZE, PMM_START / PAGE_SIZE };
+    uint32_t pages = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t i = 0; i < pmm_mmap_count; i++) {
+            uint32_t s, e;
+            if (pmm_mmap[i].type != E820_USABLE || !e820_frames(&pmm_mmap[i], &s, &e)) continue;
+            if (e > DIRECT_FRAMES) e = DIRECT_FRAMES;
+            if (s < floors[pass]) s = floors[pass];
+            if (s < pmm_holes[1][1] && s + pages > pmm_holes[1][0]) s = pmm_holes[1][1];
+            if (s + pages <= e) return s;
         }
     }
-    return NULL;
+    return PMM_NONE;
 }
 
-void pmm_free_page(void *addr) {
+static uint32_t zero_pool_shrink(uint32_t pages);
+
+void pmm_init(void) {
+    static e820_entry_t fallback = { 0, PMM_FALLBACK_TOP, E820_USABLE, 0 };
+
+    pmm_mmap = bootinfo_get_mmap(&pmm_mmap_count);
+    if (!pmm_mmap) {
+        pmm_mmap = &fallback;
+        pmm_mmap_count = 1;
+    }
+
+    /*
+     * Highest usable frame decides how many frames we track. RAM past the
+     * direct map, including above 4GB, becomes ZONE_HIGH.
+     */
+    pmm_frame_count = 0;
+    for (uint32_t i = 0; i < pmm_mmap_count; i++) {
+        uint32_t s, e;
+        if (pmm_mmap[i].type != E820_USABLE || !e820_frames(&pmm_mmap[i], &s, &e)) continue;
+        if (e > pmm_frame_count) pmm_frame_count = e;
+    }
+
+    /* Some firmware places the framebuffer inside a usable range */
+    bootinfo_t *bi = bootinfo_get();
+    pmm_holes[0][0] = pmm_holes[0][1] = 0;
+    pmm_holes[1][0] = pmm_holes[1][1] = 0;
+    if (bi && bi->vesa_mode) {
+        pmm_holes[1][0] = bi->fb_addr / PAGE_SIZE;
+        uint64_t fb_end = (uint64_t)bi->fb_addr + bi->fb_pitch * bi->fb_height;
+        pmm_holes[1][1] = (uint32_t)((fb_end + PAGE_SIZE - 1) / PAGE_SIZE);
+    }
+
+    memset(pmm_zones, 0, sizeof(pmm_zones));
+    for (int z = 0; z < ZONE_COUNT; z++) {
+        for (int o = 0; o <= PMM_MAX_ORDER; o++) pmm_zones[z].free_head[o] = PMM_NONE;
+    }
+    pmm_total_pages = 0;
+    pmm_used_pages = 0;
+    pmm_peak_pages = 0;
+
+    /* Without room for a table covering high memory, do without it */
+    uint32_t table_bytes = pmm_frame_count * sizeof(page_frame_t);
+    uint32_t table_pfn = pmm_place_frame_table(table_bytes);
+    if (table_pfn == PMM_NONE && pmm_frame_count > DIRECT_FRAMES) {
+        pmm_frame_count = DIRECT_FRAMES;
+        table_bytes = pmm_frame_count * sizeof(page_frame_t);
+        table_pfn = pmm_place_frame_table(table_bytes);
+    }
+    if (table_pfn == PMM_NONE) {
+        pmm_frame_count = 0;
+        return;
+    }
+    pmm_mem_top = (pmm_frame_count < DIRECT_FRAMES ? pmm_frame_count : DIRECT_FRAMES) * PAGE_SIZE;
+    pmm_frames = (page_frame_t *)(table_pfn * PAGE_SIZE);
+    pmm_holes[0][0] = table_pfn;
+    pmm_holes[0][1] = table_pfn + (table_bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    for (uint32_t i = 0; i < pmm_frame_count; i++) {
+        pmm_frames[i].next = PMM_NONE;
+        pmm_frames[i].prev = PMM_NONE;
+        pmm_frames[i].order = 0;
+        pmm_frames[i].flags = FRAME_RESERVED;
+        pmm_frames[i].refcount = 0;
+    }
+
+    for (uint32_t i = 0; i < pmm_mmap_count; i++) {
+        uint32_t s, e;
+        if (pmm_mmap[i].type != E820_USABLE || !e820_frames(&pmm_mmap[i], &s, &e)) continue;
+        if (s < PMM_START / PAGE_SIZE) s = PMM_START / PAGE_SIZE;
+        if (s < e) pmm_release_avoiding(s, e, i);
+    }
+
+    pmm_register_shrinker("zero pool", zero_pool_shrink, SHRINK_PRIO_FREE);
+}
+
+/*
+ * Shrinker registry, kept sorted by priority. Running shrinkers may
+ * allocate (swap-out, a disk read) and land back in pmm_alloc_pages(), so
+ * only one pass runs at a time.
+ */
+static shrinker_t shrinkers[SHRINKER_MAX];
+static uint32_t shrinker_count = 0;
+static bool shrinking = false;
+
+bool pmm_register_shrinker(const char *name, uint32_t (*scan)(uint32_t), uint32_t priority) {
+    if (shrinker_count >= SHRINKER_MAX || !scan) return false;
+
+    uint32_t i = shrinker_count++;
+    while (i > 0 && shrinkers[i - 1].priority > priority) {
+        shrinkers[i] = shrinkers[i - 1];
+        i--;
+    }
+    shrinkers[i].name = name;
+    shrinkers[i].scan = scan;
+    shrinkers[i].priority = priority;
+    shrinkers[i].calls = 0;
+    shrinkers[i].freed = 0;
+    return true;
+}
+
+uint32_t pmm_shrink(uint32_t pages) {
+    uint32_t flags = irq_save();
+    bool busy = shrinking;
+    shrinking = true;
+    irq_restore(flags);
+    if (busy) return 0;
+
+    uint32_t freed = 0;
+    for (uint32_t i = 0; i < shrinker_count && freed < pages; i++) {
+        uint32_t got = shrinkers[i].scan(pages - freed);
+        shrinkers[i].calls++;
+        shrinkers[i].freed += got;
+        freed += got;
+    }
+
+    shrinking = false;
+    return freed;
+}
+
+const shrinker_t *pmm_get_shrinkers(uint32_t *count) {
+    *count = shrinker_count;
+    return shrinkers;
+}
+
+/*
+ * Pool of pages zeroed ahead of time. Idle loops top it up through
+ * pmm_idle() so pmm_alloc_zeroed_page() rarely has to clear a page on the
+ * caller's time. Pooled pages count as allocated; the pool is the first
+ * shrinker to give them back.
+ */
+#define ZERO_POOL_SIZE   32
+#define SHRINK_BATCH     8
+
+static uint32_t zero_pool[ZERO_POOL_SIZE];
+static uint32_t zero_pool_count = 0;
+
+static void *zero_pool_take(void) {
+    uint32_t flags = irq_save();
+    void *page = zero_pool_count ? (void *)zero_pool[--zero_pool_count] : NULL;
+    irq_restore(flags);
+    return page;
+}
+
+static uint32_t zero_pool_shrink(uint32_t pages) {
+    uint32_t freed = 0;
+    void *page;
+    while (freed < pages && (page = zero_pool_take())) {
+        pmm_free_pages(page, 0);
+        freed++;
+    }
+    return freed;
+}
+
+/*
+ * Ordinary requests come from ZONE_NORMAL first and only spill into
+ * ZONE_DMA while it keeps DMA_RESERVE pages free; the reserve goes last,
+ * after the shrinkers have had a go.
+ */
+#define DMA_RESERVE 256
+#define DMA_MAX_ORDER 4            /* 64KB: buddy alignment keeps it in one ISA window */
+
+/*
+ * Allocation and free run with interrupts off: faults and IRQs can re-enter.
+ * Returns a frame number, PMM_NONE if the zone can't satisfy the request.
+ */
+static uint32_t pmm_take(uint32_t order, pmm_zone_t zone, uint32_t reserve) {
+    pmm_zone_data_t *z = &pmm_zones[zone];
+    uint32_t flags = irq_save();
+    uint32_t o = order;
+    while (o <= PMM_MAX_ORDER && z->free_head[o] == PMM_NONE) o++;
+    if (o > PMM_MAX_ORDER || z->free_pages < reserve + (1u << order)) {
+        irq_restore(flags);
+        return PMM_NONE;
+    }
+
+    uint32_t pfn = z->free_head[o];
+    pmm_list_remove(pfn);
+
+    /* Split down, returning the upper halves to the free lists */
+    while (o > order) {
+        o--;
+        pmm_list_push(pfn + (1u << o), o);
+    }
+
+    pmm_frames[pfn].order = order;
+    pmm_frames[pfn].refcount = 1;
+    pmm_used_pages += 1u << order;
+    if (pmm_used_pages > pmm_peak_pages) pmm_peak_pages = pmm_used_pages;
+    irq_restore(flags);
+    return pfn;
+}
+
+/* A direct-map block as a pointer; NULL for PMM_NONE */
+static void *pmm_block(uint32_t pfn) {
+    return pfn == PMM_NONE ? NULL : (void *)(pfn * PAGE_SIZE);
+}
+
+static void *pmm_take_any(uint32_t order, uint32_t dma_reserve) {
+    uint32_t pfn = pmm_take(order, ZONE_NORMAL, 0);
+    return pmm_block(pfn != PMM_NONE ? pfn : pmm_take(order, ZONE_DMA, dma_reserve));
+}
+
+void *pmm_alloc_pages(uint32_t order) {
+    if (order > PMM_MAX_ORDER) return NULL;
+
+    /* Out of pages: have the caches give some back and try once more */
+    void *page = pmm_take_any(order, DMA_RESERVE);
+    if (!page && pmm_shrink(order ? 1u << order : SHRINK_BATCH)) {
+        page = pmm_take_any(order, DMA_RESERVE);
+    }
+    return page ? page : pmm_block(pmm_take(order, ZONE_DMA, 0));
+}
+
+/* Below ZONE_DMA_LIMIT and never crossing a 64KB boundary */
+void *pmm_alloc_dma(uint32_t order) {
+    if (order > DMA_MAX_ORDER) return NULL;
+
+    void *page = pmm_block(pmm_take(order, ZONE_DMA, 0));
+    if (!page && pmm_shrink(1u << order)) page = pmm_block(pmm_take(order, ZONE_DMA, 0));
+    return page;
+}
+
+static void pmm_free_frames(uint32_t pfn, uint32_t order) {
+    if (pfn < PMM_START / PAGE_SIZE || pfn >= pmm_frame_count || order > PMM_MAX_ORDER) return;
+    if (pmm_frames[pfn].flags || pmm_frames[pfn].order != order) return;
+
+    uint32_t flags = irq_save();
+    pmm_used_pages -= 1u << order;
+    pmm_free_block(pfn, order);
+    irq_restore(flags);
+}
+
+void pmm_free_pages(void *addr, uint32_t order) {
     uint32_t phys = (uint32_t)addr;
-    if (phys < PMM_START) return;
-    uint32_t page = (phys - PMM_START) / PAGE_SIZE;
-    if (page < pmm_total_pages && pmm_test_bit(page)) {
-        pmm_clear_bit(page);
-        pmm_used_pages--;
+    if (!(phys & (PAGE_SIZE - 1))) pmm_free_frames(phys / PAGE_SIZE, order);
+}
+
+void *pmm_alloc_page(void) {
+    return pmm_alloc_pages(0);
+}
+
+void pmm_free_page(void *addr) {
+    pmm_free_pages(addr, 0);
+}
+
+void *pmm_alloc_zeroed_page(void) {
+    void *page = zero_pool_take();
+    if (page) return page;
+
+    page = pmm_alloc_pages(0);
+    if (page) memset(page, 0, PAGE_SIZE);
+    return page;
+}
+
+/*
+ * One step of background work; false if there was nothing to do. Below
+ * the low watermark the step reclaims a batch, otherwise it zeroes one
+ * more page into the pool.
+ */
+bool pmm_idle(void) {
+    uint32_t free = pmm_total_pages - pmm_used_pages;
+    if (free < PMM_WMARK_LOW) {
+        uint32_t want = PMM_WMARK_HIGH - free;
+        return pmm_shrink(want < SHRINK_BATCH ? want : SHRINK_BATCH) != 0;
+    }
+
+    if (zero_pool_count >= ZERO_POOL_SIZE || free <= PMM_WMARK_HIGH) return false;
+
+    void *page = pmm_alloc_pages(0);
+    if (!page) return false;
+    memset(page, 0, PAGE_SIZE);
+
+    uint32_t flags = irq_save();
+    bool stored = zero_pool_count < ZERO_POOL_SIZE;
+    if (stored) zero_pool[zero_pool_count++] = (uint32_t)page;
+    irq_restore(flags);
+
+    if (!stored) pmm_free_pages(page, 0);
+    return stored;
+}
+
+static page_frame_t *pmm_frame_of(uint32_t pfn) {
+    if (pfn < PMM_START / PAGE_SIZE || pfn >= pmm_frame_count || pmm_frames[pfn].flags) return NULL;
+    return &pmm_frames[pfn];
+}
+
+void pmm_page_get(uint32_t pfn) {
+    page_frame_t *f = pmm_frame_of(pfn);
+    if (f) f->refcount++;
+}
+
+void pmm_page_put(uint32_t pfn) {
+    page_frame_t *f = pmm_frame_of(pfn);
+    if (f && --f->refcount == 0) pmm_free_frames(pfn, 0);
+}
+
+uint32_t pmm_page_refs(uint32_t pfn) {
+    page_frame_t *f = pmm_frame_of(pfn);
+    return f ? f->refcount : 0;
+}
+
+/*
+ * A page for user space: from high memory while it lasts, so the direct
+ * map is left to the kernel, otherwise an ordinary page. Returns the frame
+ * number, or 0.
+ */
+uint32_t pmm_alloc_user_frame(bool zero) {
+    uint32_t pfn = pmm_take(0, ZONE_HIGH, 0);
+    if (pfn != PMM_NONE) {
+        if (zero) {
+            void *page = kmap(pfn);
+            if (!page) {
+                pmm_free_frames(pfn, 0);
+                return 0;
+            }
+            memset(page, 0, PAGE_SIZE);
+            kunmap(page);
+        }
+        return pfn;
     }
+
+    void *page = zero ? pmm_alloc_zeroed_page() : pmm_alloc_page();
+    return page ? (uint32_t)page / PAGE_SIZE : 0;
+}
+
+uint32_t pmm_size_to_order(uint32_t size) {
+    uint32_t order = 0;
+    while (order < PMM_MAX_ORDER && ((uint32_t)PAGE_SIZE << order) < size) order++;
+    return order;
 }
 
 uint32_t pmm_get_free_pages(void) {
@@ -63,128 +509,1022 @@ uint32_t pmm_get_total_pages(void) {
     return pmm_total_pages;
 }
 
+uint32_t pmm_get_mem_top(void) {
+    return pmm_mem_top;
+}
+
+uint32_t pmm_get_zeroed_pages(void) {
+    return zero_pool_count;
+}
+
+uint32_t pmm_get_peak_pages(void) {
+    return pmm_peak_pages;
+}
+
+uint32_t pmm_get_free_blocks(uint32_t order) {
+    if (order > PMM_MAX_ORDER) return 0;
+    uint32_t n = 0;
+    for (int z = 0; z < ZONE_COUNT; z++) n += pmm_zones[z].free_count[order];
+    return n;
+}
+
+uint32_t pmm_get_zone_free(pmm_zone_t zone) {
+    return zone < ZONE_COUNT ? pmm_zones[zone].free_pages : 0;
+}
+
+uint32_t pmm_get_zone_total(pmm_zone_t zone) {
+    return zone < ZONE_COUNT ? pmm_zones[zone].total_pages : 0;
+}
+
+/*
+ * PAE paging: a 4-entry page-directory-pointer table (PDPT) selects one of
+ * four page directories per gigabyte, each holding 512 64-bit PDEs that
+ * map 2MB apiece, either directly (PG_LARGE) or through a 512-entry page
+ * table. The kernel PDPT sits at PD_ADDR with its four directories in the
+ * pages right after it.
+ */
 #define PD_ADDR  0x30000
-#define PT_ADDR  0x31000
+#define PG_LARGE 0x80        /* PDE maps a 2MB page */
+
+#define PG_PWT   0x08
+#define PG_PCD   0x10
+
+#define PTE_INDEX(v)   (((v) >> 12) & 511)
+#define PDE_INDEX(v)   (((v) >> 21) & 511)
+#define PDPT_INDEX(v)  ((v) >> 30)
+
+#define MSR_PAT  0x277
+#define MSR_EFER 0xC0000080
+#define EFER_NXE (1 << 11)
+
+static uint32_t identity_size = 0;
+static bool pat_enabled = false;
+static pte_t nx_bit = 0;     /* PG_NX once EFER.NXE is on; reserved otherwise */
+
+static uint32_t cpuid_edx(uint32_t leaf) {
+    uint32_t a, b, c, d;
+    __asm__ volatile("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(leaf));
+    return d;
+}
+
+/*
+ * Keep the power-on PAT layout except entry 1 (selected by PWT alone),
+ * which becomes write-combining: PA0 WB, PA1 WC, PA2 UC-, PA3 UC, and the
+ * upper four entries as reset. Only PA0-PA3 are ever used, so the PAT bit
+ * in PTEs/PDEs stays clear.
+ */
+static void pat_init(void) {
+    wrmsr(MSR_PAT, 0x0007040600070106ULL);
+    pat_enabled = true;
+}
 
+static uint32_t cache_bits(page_cache_t cache) {
+    switch (cache) {
+        case PAGE_CACHE_WC: return pat_enabled ? PG_PWT : PG_PCD | PG_PWT;
+        case PAGE_CACHE_UC: return PG_PCD | PG_PWT;
+        default:            return 0;
+    }
+}
+
+static pte_t *paging_table_for(uint32_t virt, bool create);
+static pte_t *kmap_table = NULL;
+
+/* Kernel PDE covering virt; the four kernel directories always exist */
+static pte_t *kernel_pde(uint32_t virt) {
+    return (pte_t *)(PD_ADDR + (1 + PDPT_INDEX(virt)) * PAGE_SIZE) + PDE_INDEX(virt);
+}
+
+/*
+ * Identity-map all RAM the PMM manages with 2MB pages, so no page tables
+ * are spent on it and a full-screen sweep touches a handful of TLB
+ * entries. Only the first 2MB, which holds the kernel image, stays
+ * executable.
+ */
 void paging_init(void) {
-    uint32_t *page_dir = (uint32_t *)PD_ADDR;
-    memset(page_dir, 0, PAGE_SIZE);
+    pte_t *pdpt = (pte_t *)PD_ADDR;
+    memset(pdpt, 0, 5 * PAGE_SIZE);
+    for (uint32_t i = 0; i < 4; i++) pdpt[i] = (PD_ADDR + (1 + i) * PAGE_SIZE) | PG_PRESENT;
 
-    for (int i = 0; i < 4; i++) {
-        uint32_t *page_table = (uint32_t *)(PT_ADDR + i * PAGE_SIZE);
+    uint32_t features = cpuid_edx(1);
+    if (features & (1 << 16)) pat_init();
 
-        for (int j = 0; j < 1024; j++) {
-            uint32_t phys_addr = (i * 1024 + j) * PAGE_SIZE;
-            page_table[j] = phys_addr | 0x03;
-        }
+    if (cpuid_edx(0x80000000) >= 0x80000001 && (cpuid_edx(0x80000001) & (1 << 20))) {
+        wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_NXE);
+        nx_bit = PG_NX;
+    }
 
-        page_dir[i] = ((uint32_t)page_table) | 0x03;
+    uint32_t top = pmm_mem_top ? pmm_mem_top : PMM_FALLBACK_TOP;
+    uint32_t v;
+    for (v = 0; v < top && v < PHYS_DIRECT_LIMIT; v += LARGE_PAGE_SIZE) {
+        *kernel_pde(v) = v | PG_LARGE | PG_WRITE | PG_PRESENT | (v ? nx_bit : 0);
     }
+    identity_size = v;
 
+    /* PAE, then PG + WP: the kernel must fault on copy-on-write pages too */
     __asm__ volatile(
+        "mov %%cr4, %%eax\n"
+        "or $0x20, %%eax\n"
+        "mov %%eax, %%cr4\n"
         "mov %0, %%cr3\n"
         "mov %%cr0, %%eax\n"
-        "or $0x80000000, %%eax\n"
+        "or $0x80010000, %%eax\n"
         "mov %%eax, %%cr0\n"
         :
         : "r"(PD_ADDR)
         : "eax"
     );
+
+    /* Slots for kmap(), only needed if there is RAM past the direct map */
+    if (pmm_frame_count > DIRECT_FRAMES) kmap_table = paging_table_for(KMAP_BASE, true);
+}
+
+uint32_t paging_get_identity_size(void) {
+    return identity_size;
+}
+
+bool paging_has_nx(void) {
+    return nx_bit != 0;
+}
+
+bool paging_has_pat(void) {
+    return pat_enabled;
+}
+
+/*
+ * TLB maintenance. Outside a batch every PTE change is followed by an
+ * invlpg of just that page. Between paging_batch_begin() and
+ * paging_batch_end() the addresses are collected instead and invalidated
+ * together at the end, falling back to one CR3 reload if there are too
+ * many. Inside a batch, don't touch a page you unmapped or remapped until
+ * the batch ends. Newly mapped pages are fine, since x86 never caches
+ * not-present entries.
+ *
+ * The depth belongs to the running task and is swapped by the scheduler
+ * through paging_batch_switch(), which also issues whatever is pending, so
+ * a batch runs with IRQs on and no other task ever sees our stale entries
+ * or defers its own into our batch. Only the list update itself is done
+ * with IRQs off. Pending work is bounded at PAGING_BATCH_MAX invlpgs, or a
+ * single CR3 reload past that, however long the batch runs.
+ */
+#define PAGING_BATCH_MAX 32
+
+static uint32_t batch_depth = 0;    /* of the running task */
+static uint32_t batch_count = 0;
+static uint32_t batch_pages[PAGING_BATCH_MAX];
+
+static inline void invlpg(uint32_t virt) {
+    __asm__ volatile("invlpg (%0)" :: "r"(virt) : "memory");
+}
+
+/* Also reloads the PDPT registers, which only a CR3 write refreshes */
+static inline void flush_tlb(void) {
+    __asm__ volatile("mov %%cr3, %%eax\nmov %%eax, %%cr3" ::: "eax", "memory");
+}
+
+/* Issue the pending invalidations; IRQs must be off */
+static void batch_flush(void) {
+    if (batch_count > PAGING_BATCH_MAX) {
+        flush_tlb();
+    } else {
+        for (uint32_t i = 0; i < batch_count; i++) invlpg(batch_pages[i]);
+    }
+    batch_count = 0;
+}
+
+static void paging_flush_page(uint32_t virt) {
+    uint32_t flags = irq_save();
+    if (!batch_depth) {
+        invlpg(virt);
+    } else {
+        if (batch_count < PAGING_BATCH_MAX) batch_pages[batch_count] = virt;
+        batch_count++;
+    }
+    irq_restore(flags);
+}
+
+void paging_batch_begin(void) {
+    batch_depth++;
+}
+
+void paging_batch_end(void) {
+    if (!batch_depth || --batch_depth) return;
+
+    uint32_t flags = irq_save();
+    batch_flush();
+    irq_restore(flags);
+}
+
+/* Called by the scheduler, IRQs off: returns the outgoing task's depth */
+uint32_t paging_batch_switch(uint32_t depth) {
+    batch_flush();
+    uint32_t old = batch_depth;
+    batch_depth = depth;
+    return old;
 }
 
-#define EXTRA_PT_BASE 0x35000
-static int next_pt_slot = 0;
+/*
+ * Kernel page table covering virt. A large page there is split into an
+ * equivalent table first; an empty slot gets a fresh table only if
+ * `create` is set. Tables come from the PMM; NULL if it is out of pages.
+ * The kernel directories are shared by every address space, so a table
+ * added here is visible everywhere at once and is never freed.
+ */
+static pte_t *paging_table_for(uint32_t virt, bool create) {
+    pte_t *pde = kernel_pde(virt);
+
+    if ((*pde & PG_PRESENT) && !(*pde & PG_LARGE)) {
+        return (pte_t *)(uint32_t)(*pde & PTE_FRAME);
+    }
+    if (!(*pde & PG_PRESENT) && !create) return NULL;
+
+    pte_t *page_table = (pte_t *)pmm_alloc_page();
+    if (!page_table) return NULL;
 
-void paging_map_region(uint32_t virt, uint32_t phys, uint32_t size, uint32_t flags) {
-    uint32_t *page_dir = (uint32_t *)PD_ADDR;
+    if (*pde & PG_PRESENT) {
+        uint32_t base = (uint32_t)*pde & ~(LARGE_PAGE_SIZE - 1);
+        pte_t bits = *pde & (0x1F | PG_NX);
+        for (int j = 0; j < 512; j++) page_table[j] = (base + j * PAGE_SIZE) | bits;
+        pte_set(pde, (uint32_t)page_table | bits);
+    } else {
+        memset(page_table, 0, PAGE_SIZE);
+        pte_set(pde, (uint32_t)page_table | PG_WRITE | PG_PRESENT);
+    }
+    return page_table;
+}
 
+/*
+ * Kernel mappings are never executed from, so they all get NX.
+ * False if a page table couldn't be allocated; earlier pages stay mapped.
+ */
+bool paging_map_region(uint32_t virt, uint32_t phys, uint32_t size, uint32_t flags,
+                       page_cache_t cache) {
+    pte_t bits = flags | cache_bits(cache) | PG_PRESENT | nx_bit;
+    bool ok = true;
+
+    paging_batch_begin();
     for (uint32_t offset = 0; offset < size; offset += PAGE_SIZE) {
         uint32_t v = virt + offset;
         uint32_t p = phys + offset;
-        uint32_t pd_index = v >> 22;
-        uint32_t pt_index = (v >> 12) & 0x3FF;
 
-        if (!(page_dir[pd_index] & 0x01)) {
-            uint32_t pt_phys = EXTRA_PT_BASE + next_pt_slot * PAGE_SIZE;
-            next_pt_slot++;
-            memset((void *)pt_phys, 0, PAGE_SIZE);
-            page_dir[pd_index] = pt_phys | flags | 0x01;
+        pte_t *page_table = paging_table_for(v, true);
+        if (!page_table) {
+            ok = false;
+            break;
         }
+        pte_t *pte = &page_table[PTE_INDEX(v)];
+        bool was_present = *pte & PG_PRESENT;
+        pte_set(pte, p | bits);
+        if (was_present) paging_flush_page(v);
+    }
+    paging_batch_end();
+    return ok;
+}
+
+/*
+ * Map [virt, virt + size) with 2MB pages, widened to 2MB boundaries. virt
+ * and phys must share the same offset within a 2MB page. Returns false
+ * (mapping nothing) if the alignment doesn't allow it, so callers can fall
+ * back to paging_map_region().
+ */
+bool paging_map_large(uint32_t virt, uint32_t phys, uint32_t size, uint32_t flags,
+                      page_cache_t cache) {
+    if (size == 0 || ((virt ^ phys) & (LARGE_PAGE_SIZE - 1))) return false;
+
+    uint32_t v = virt & ~(LARGE_PAGE_SIZE - 1);
+    uint32_t last = (virt + size - 1) & ~(LARGE_PAGE_SIZE - 1);
+    uint32_t p = phys & ~(LARGE_PAGE_SIZE - 1);
 
-        uint32_t *page_table = (uint32_t *)(page_dir[pd_index] & 0xFFFFF000);
-        page_table[pt_index] = p | flags | 0x01;
+    /* A table replaced by a large page could have had any of its 512
+     * entries cached, so this one always flushes everything */
+    for (;; v += LARGE_PAGE_SIZE, p += LARGE_PAGE_SIZE) {
+        pte_set(kernel_pde(v), p | flags | cache_bits(cache) | PG_LARGE | PG_PRESENT | nx_bit);
+        if (v == last) break;
     }
 
-    __asm__ volatile("mov %%cr3, %%eax\nmov %%eax, %%cr3" ::: "eax");
+    flush_tlb();
+    return true;
 }
 
-#define HEAP_START 0x200000
-#define HEAP_SIZE  0x200000
+/* Clear the PTEs for [virt, virt + size); the frames are the caller's */
+void paging_unmap_region(uint32_t virt, uint32_t size) {
+    paging_batch_begin();
+    for (uint32_t offset = 0; offset < size; offset += PAGE_SIZE) {
+        uint32_t v = virt + offset;
+        pte_t *page_table = paging_table_for(v, false);
+        if (!page_table) continue;
+
+        pte_t *pte = &page_table[PTE_INDEX(v)];
+        if (*pte & PG_PRESENT) {
+            pte_set(pte, 0);
+            paging_flush_page(v);
+        }
+    }
+    paging_batch_end();
+}
+
+uint32_t paging_get_phys(uint32_t virt) {
+    pte_t pde = *kernel_pde(virt);
+    if (!(pde & PG_PRESENT)) return 0;
+    if (pde & PG_LARGE) return ((uint32_t)pde & ~(LARGE_PAGE_SIZE - 1)) | (virt & (LARGE_PAGE_SIZE - 1));
+
+    pte_t pte = ((pte_t *)(uint32_t)(pde & PTE_FRAME))[PTE_INDEX(virt)];
+    if (!(pte & PG_PRESENT)) return 0;
+    return ((uint32_t)pte & 0xFFFFF000) | (virt & 0xFFF);
+}
+
+/*
+ * Make kernel-image pages in [start, end) reachable from ring 3, read-only.
+ * Used for the user program that is linked into the kernel image.
+ */
+void paging_expose_to_user(uint32_t start, uint32_t end) {
+    for (uint32_t v = start & ~(PAGE_SIZE - 1); v < end; v += PAGE_SIZE) {
+        pte_t *page_table = paging_table_for(v, true);
+        if (!page_table) break;
+        pte_t *pte = &page_table[PTE_INDEX(v)];
+        pte_set(pte, (*pte & ~(pte_t)PG_WRITE) | PG_USER);
+        *kernel_pde(v) |= PG_USER;
+    }
+
+    flush_tlb();
+}
+
+/*
+ * Temporary kernel views of frames outside the direct map. The window at
+ * KMAP_BASE is one page table of slots handed out from a bitmap; a direct
+ * frame is just returned at its own address. Slots are shared by all tasks
+ * and unmapped with an immediate invlpg, never a batched one, since the
+ * next kmap() may reuse them at once. NULL when every slot is taken.
+ */
+static uint32_t kmap_used[KMAP_SLOTS / 32];
+
+void *kmap(uint32_t pfn) {
+    if (pfn < DIRECT_FRAMES) return (void *)(pfn * PAGE_SIZE);
+    if (!kmap_table) return NULL;
+
+    uint32_t flags = irq_save();
+    for (uint32_t w = 0; w < KMAP_SLOTS / 32; w++) {
+        if (kmap_used[w] == 0xFFFFFFFF) continue;
+
+        uint32_t slot = w * 32 + __builtin_ctz(~kmap_used[w]);
+        kmap_used[w] |= 1u << (slot % 32);
+        pte_set(&kmap_table[slot], ((pte_t)pfn << 12) | PG_WRITE | PG_PRESENT | nx_bit);
+        irq_restore(flags);
+        return (void *)(KMAP_BASE + slot * PAGE_SIZE);
+    }
+    irq_restore(flags);
+    return NULL;
+}
+
+void kunmap(void *addr) {
+    uint32_t v = (uint32_t)addr;
+    if (v < KMAP_BASE || v >= KMAP_BASE + KMAP_SLOTS * PAGE_SIZE) return;
+
+    uint32_t slot = (v - KMAP_BASE) / PAGE_SIZE;
+    uint32_t flags = irq_save();
+    pte_set(&kmap_table[slot], 0);
+    invlpg(v & ~(PAGE_SIZE - 1));
+    kmap_used[slot / 32] &= ~(1u << (slot % 32));
+    irq_restore(flags);
+}
+
+/*
+ * Address spaces. A space is a PDPT whose first and last entries point at
+ * the kernel's own directories, so kernel mappings (identity map, heap,
+ * stacks, framebuffer) are literally shared and only the USER_BASE ..
+ * USER_TOP gigabytes have private directories, allocated on first use.
+ *
+ * fork() copies the user page tables but not the pages: writable pages
+ * become read-only + PG_COW in both spaces, and the PMM refcount says how
+ * many PTEs point at each. The first write to such a page copies it, or
+ * simply reclaims write access if nobody else holds it any more.
+ */
+#define USER_PDPT_FIRST PDPT_INDEX(USER_BASE)
+#define USER_PDPT_END   PDPT_INDEX(USER_TOP)
+
+uint32_t paging_kernel_dir(void) {
+    return PD_ADDR;
+}
+
+uint32_t paging_create_space(void) {
+    pte_t *pdpt = (pte_t *)pmm_alloc_zeroed_page();
+    if (!pdpt) return 0;
+
+    pte_t *kernel_pdpt = (pte_t *)PD_ADDR;
+    for (uint32_t i = 0; i < 4; i++) {
+        if (i < USER_PDPT_FIRST || i >= USER_PDPT_END) pdpt[i] = kernel_pdpt[i];
+    }
+    return (uint32_t)pdpt;
+}
+
+/* Directory, then table, for a user address; NULL where either is missing */
+static pte_t *user_pd(uint32_t dir, uint32_t virt) {
+    pte_t pdpte = ((pte_t *)dir)[PDPT_INDEX(virt)];
+    return (pdpte & PG_PRESENT) ? (pte_t *)(uint32_t)(pdpte & PTE_FRAME) : NULL;
+}
+
+pte_t *paging_user_pte(uint32_t dir, uint32_t virt) {
+    if (virt < USER_BASE || virt >= USER_TOP) return NULL;
+    pte_t *pd = user_pd(dir, virt);
+    if (!pd || !(pd[PDE_INDEX(virt)] & PG_PRESENT)) return NULL;
+    return (pte_t *)(uint32_t)(pd[PDE_INDEX(virt)] & PTE_FRAME) + PTE_INDEX(virt);
+}
+
+static void clone_table(pte_t *src_pt, pte_t *dst_pt) {
+    for (uint32_t j = 0; j < 512; j++) {
+        pte_t pte = src_pt[j];
+        if (pte & PG_PRESENT) {
+            if (pte & PG_WRITE) pte = (pte & ~(pte_t)PG_WRITE) | PG_COW;
+            pte_set(&src_pt[j], pte);
+            pmm_page_get(PTE_PFN(pte));
+        } else if (pte & PG_SWAPPED) {
+            swap_slot_dup(pte);
+        }
+        dst_pt[j] = pte;
+    }
+}
+
+uint32_t paging_clone_space(uint32_t src) {
+    uint32_t dst = paging_create_space();
+    if (!dst) return 0;
+
+    for (uint32_t i = USER_PDPT_FIRST; i < USER_PDPT_END && dst; i++) {
+        pte_t *src_pd = user_pd(src, i << 30);
+        if (!src_pd) continue;
+
+        pte_t *dst_pd = (pte_t *)pmm_alloc_zeroed_page();
+        if (!dst_pd) {
+            paging_destroy_space(dst);
+            dst = 0;
+            break;
+        }
+        ((pte_t *)dst)[i] = (uint32_t)dst_pd | PG_PRESENT;
+
+        for (uint32_t j = 0; j < 512; j++) {
+            if (!(src_pd[j] & PG_PRESENT)) continue;
+
+            pte_t *dst_pt = (pte_t *)pmm_alloc_page();
+            if (!dst_pt) {
+                paging_destroy_space(dst);
+                dst = 0;
+                break;
+            }
+            clone_table((pte_t *)(uint32_t)(src_pd[j] & PTE_FRAME), dst_pt);
+            dst_pd[j] = (uint32_t)dst_pt | (src_pd[j] & 0xFFF);
+        }
+    }
+
+    /* The source lost write access to its pages */
+    if (read_cr3() == src) flush_tlb();
+    return dst;
+}
+
+void paging_destroy_space(uint32_t dir) {
+    if (dir == PD_ADDR) return;
+
+    for (uint32_t i = USER_PDPT_FIRST; i < USER_PDPT_END; i++) {
+        pte_t *pd = user_pd(dir, i << 30);
+        if (!pd) continue;
+
+        for (uint32_t j = 0; j < 512; j++) {
+            if (!(pd[j] & PG_PRESENT)) continue;
+
+            pte_t *page_table = (pte_t *)(uint32_t)(pd[j] & PTE_FRAME);
+            for (uint32_t k = 0; k < 512; k++) {
+                pte_t pte = page_table[k];
+                if (pte & PG_PRESENT) pmm_page_put(PTE_PFN(pte));
+                else if (pte & PG_SWAPPED) swap_slot_free(pte);
+            }
+            pmm_free_page(page_table);
+        }
+        pmm_free_page(pd);
+    }
+    pmm_free_page((void *)dir);
+}
+
+void paging_switch(uint32_t dir) {
+    if (read_cr3() != dir) {
+        __asm__ volatile("mov %0, %%cr3" :: "r"(dir) : "memory");
+    }
+}
+
+/*
+ * Map frame `pfn` as one user page of `dir`; the frame's reference passes
+ * to the mapping. User pages are data only (user code lives in the exposed
+ * kernel image), so they are NX too.
+ */
+bool paging_map_user(uint32_t dir, uint32_t virt, uint32_t pfn, uint32_t flags) {
+    if (virt < USER_BASE || virt >= USER_TOP) return false;
+
+    pte_t *pd = user_pd(dir, virt);
+    if (!pd) {
+        pd = (pte_t *)pmm_alloc_zeroed_page();
+        if (!pd) return false;
+        ((pte_t *)dir)[PDPT_INDEX(virt)] = (uint32_t)pd | PG_PRESENT;
+        if (read_cr3() == dir) flush_tlb();
+    }
+
+    pte_t *pde = &pd[PDE_INDEX(virt)];
+    if (!(*pde & PG_PRESENT)) {
+        pte_t *page_table = (pte_t *)pmm_alloc_zeroed_page();
+        if (!page_table) return false;
+        pte_set(pde, (uint32_t)page_table | PG_USER | PG_WRITE | PG_PRESENT);
+    }
+
+    pte_t *pte = (pte_t *)(uint32_t)(*pde & PTE_FRAME) + PTE_INDEX(virt);
+    pte_set(pte, ((pte_t)pfn << 12) | flags | PG_USER | PG_PRESENT | nx_bit);
+
+    paging_invalidate(dir, virt);
+    return true;
+}
+
+/* Remove one user page from `dir`, handing its reference to the caller */
+uint32_t paging_unmap_user(uint32_t dir, uint32_t virt) {
+    pte_t *pte = paging_user_pte(dir, virt);
+    if (!pte) return 0;
+
+    if (!(*pte & PG_PRESENT)) {
+        if (*pte & PG_SWAPPED) swap_slot_free(*pte);
+        pte_set(pte, 0);
+        return 0;
+    }
+
+    uint32_t pfn = PTE_PFN(*pte);
+    pte_set(pte, 0);
+    paging_invalidate(dir, virt);
+    return pfn;
+}
+
+void paging_invalidate(uint32_t dir, uint32_t virt) {
+    if (read_cr3() == dir) paging_flush_page(virt);
+}
+
+/* Try to resolve a page fault; false means it is a genuine access violation */
+bool paging_handle_fault(uint32_t addr, uint32_t err) {
+    uint32_t dir = read_cr3();
+    if (addr < USER_BASE || addr >= USER_TOP || (err & PF_INSTR)) return false;
+
+    pte_t *pte = paging_user_pte(dir, addr);
+
+    if (!(err & PF_PRESENT)) {
+        if (pte && (*pte & PG_SWAPPED)) return swap_fault_in(pte);
+
+        /* First touch of the stack: back it with a zeroed page */
+        if (addr < USER_STACK_TOP - USER_STACK_MAX || addr >= USER_STACK_TOP) return false;
+
+        uint32_t pfn = pmm_alloc_user_frame(true);
+        if (!pfn) return false;
+        if (!paging_map_user(dir, addr & ~(PAGE_SIZE - 1), pfn, PG_WRITE)) {
+            pmm_page_put(pfn);
+            return false;
+        }
+        return true;
+    }
+
+    if (!(err & PF_WRITE) || !pte || !(*pte & PG_COW)) return false;
+
+    uint32_t pfn = PTE_PFN(*pte);
+    pte_t bits = (*pte & ~PTE_FRAME & ~(pte_t)PG_COW) | PG_WRITE;
+
+    if (pmm_page_refs(pfn) > 1) {
+        uint32_t copy = pmm_alloc_user_frame(false);
+        void *dst = copy ? kmap(copy) : NULL;
+        void *src = dst ? kmap(pfn) : NULL;
+        if (!src) {
+            if (dst) kunmap(dst);
+            if (copy) pmm_page_put(copy);
+            return false;
+        }
+        memcpy(dst, src, PAGE_SIZE);
+        kunmap(src);
+        kunmap(dst);
+        pmm_page_put(pfn);
+        pfn = copy;
+    }
+
+    pte_set(pte, ((pte_t)pfn << 12) | bits);
+    invlpg(addr & ~(PAGE_SIZE - 1));
+    return true;
+}
+
+/*
+ * Kernel heap: boundary-tagged blocks on segregated free lists.
+ *
+ * Every block starts with a header word and ends with a footer word, both
+ * holding the block's total size with bit 0 set while it is allocated. The
+ * footer of the previous block sits just before our header, so both
+ * neighbours can be found and merged in constant time. Free blocks keep
+ * their list links in the payload. Free list n holds blocks with sizes in
+ * [2^(n+4), 2^(n+5)); a bitmap of non-empty lists makes the search O(1).
+ *
+ * The heap spans the whole KHEAP_BASE window from boot, as one free block,
+ * but only pages that hold live data or block tags are backed by RAM.
+ * kmalloc() maps whatever pages a new block needs; kfree() hands the
+ * interior pages of large free blocks back to the PMM. The page tables are
+ * the only record of which heap pages are backed.
+ */
+#define HEAP_USED       0x01
+#define HEAP_ALIGN      8
+#define HEAP_OVERHEAD   8                     /* header + footer */
+#define HEAP_MIN_BLOCK  (HEAP_OVERHEAD + 16)  /* room for free-list links */
+#define HEAP_MIN_SHIFT  4
+#define HEAP_CLASSES    28
+#define HEAP_TRIM       0x10000               /* free blocks this big give pages back */
 
-typedef struct heap_block {
-    uint32_t size;
-    bool is_free;
-    struct heap_block *next;
-} heap_block_t;
+typedef struct heap_free {
+    uint32_t header;
+    struct heap_free *next;
+    struct heap_free *prev;
+} heap_free_t;
 
-static heap_block_t *heap_head = NULL;
+static heap_free_t *heap_lists[HEAP_CLASSES];
+static uint32_t heap_list_map = 0;
 static uint32_t heap_used = 0;
+static uint32_t heap_mapped = 0;
+
+/*
+ * Instrumentation. Counters and the live-size histogram are always kept.
+ * With caller tracking on, each new block gets one extra word at the end
+ * of its payload holding the kmalloc() return address, and HEAP_TRACKED in
+ * its header, so kfree() can charge the release back to the same site.
+ */
+#define HEAP_TRACKED    0x02
+
+static heap_stats_t heap_stats;
+static heap_site_t heap_sites[HEAP_SITES];
+static bool heap_tracking = false;
+
+#define BLK_SIZE(b)      (*(uint32_t *)(b) & ~(HEAP_ALIGN - 1))
+#define BLK_USED(b)      (*(uint32_t *)(b) & HEAP_USED)
+#define BLK_NEXT(b)      ((uint8_t *)(b) + BLK_SIZE(b))
+#define BLK_PREV_TAG(b)  (*((uint32_t *)(b) - 1))
+
+static uint32_t heap_class(uint32_t size) {
+    uint32_t c = (31 - __builtin_clz(size)) - HEAP_MIN_SHIFT;
+    return c < HEAP_CLASSES ? c : HEAP_CLASSES - 1;
+}
+
+static void heap_set_tags(void *blk, uint32_t size, uint32_t used) {
+    *(uint32_t *)blk = size | used;
+    *((uint32_t *)((uint8_t *)blk + size) - 1) = size | used;
+}
+
+static void heap_list_insert(heap_free_t *blk) {
+    uint32_t c = heap_class(BLK_SIZE(blk));
+    blk->prev = NULL;
+    blk->next = heap_lists[c];
+    if (blk->next) blk->next->prev = blk;
+    heap_lists[c] = blk;
+    heap_list_map |= 1u << c;
+}
+
+static void heap_list_remove(heap_free_t *blk) {
+    uint32_t c = heap_class(BLK_SIZE(blk));
+    if (blk->prev) blk->prev->next = blk->next;
+    else heap_lists[c] = blk->next;
+    if (blk->next) blk->next->prev = blk->prev;
+    if (!heap_lists[c]) heap_list_map &= ~(1u << c);
+}
+
+#define PAGE_DOWN(a)  ((a) & ~(PAGE_SIZE - 1))
+#define PAGE_UP(a)    (((a) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+
+/*
+ * Back every page touching [start, end). Frames are allocated with IRQs
+ * on, since that may reclaim, but each page is checked and mapped with
+ * them off: the first and last pages may be shared with a block another
+ * task is backing at the same time.
+ */
+static bool heap_map_range(uint32_t start, uint32_t end) {
+    bool ok = true;
+
+    paging_batch_begin();
+    for (uint32_t v = PAGE_DOWN(start); v < end; v += PAGE_SIZE) {
+        if (paging_get_phys(v)) continue;
+        void *page = pmm_alloc_page();
+        if (!page) {
+            ok = false;
+            break;
+        }
+
+        uint32_t flags = irq_save();
+        bool raced = paging_get_phys(v) != 0;
+        bool mapped = !raced && paging_map_region(v, (uint32_t)page, PAGE_SIZE, 0x03,
+                                                  PAGE_CACHE_WB);
+        if (mapped) heap_mapped += PAGE_SIZE;
+        irq_restore(flags);
+
+        if (mapped) continue;
+        pmm_free_page(page);
+        if (!raced) {
+            ok = false;
+            break;
+        }
+    }
+    paging_batch_end();
+    return ok;
+}
+
+/* Return the pages of a page-aligned range to the PMM */
+static void heap_unmap_range(uint32_t start, uint32_t end) {
+    paging_batch_begin();
+    for (uint32_t v = start; v < end; v += PAGE_SIZE) {
+        uint32_t phys = paging_get_phys(v);
+        if (!phys) continue;
+        paging_unmap_region(v, PAGE_SIZE);
+        pmm_free_page((void *)phys);
+        heap_mapped -= PAGE_SIZE;
+    }
+    paging_batch_end();
+}
 
 void heap_init(void) {
-    heap_head = (heap_block_t *)HEAP_START;
-    heap_head->size = HEAP_SIZE - sizeof(heap_block_t);
-    heap_head->is_free = true;
-    heap_head->next = NULL;
+    memset(heap_lists, 0, sizeof(heap_lists));
+    heap_list_map = 0;
     heap_used = 0;
+    heap_mapped = 0;
+    memset(&heap_stats, 0, sizeof(heap_stats));
+
+    uint32_t last_page = KHEAP_BASE + KHEAP_MAX - PAGE_SIZE;
+    if (!heap_map_range(KHEAP_BASE, KHEAP_BASE + 1) ||
+        !heap_map_range(last_page, last_page + 1)) {
+        return;
+    }
+
+    /* Prologue footer and epilogue header are permanently "used" */
+    uint32_t *prologue = (uint32_t *)KHEAP_BASE;
+    uint32_t *epilogue = (uint32_t *)(KHEAP_BASE + KHEAP_MAX) - 1;
+    *prologue = HEAP_USED;
+    *epilogue = HEAP_USED;
+
+    heap_free_t *blk = (heap_free_t *)(prologue + 1);
+    heap_set_tags(blk, KHEAP_MAX - 2 * sizeof(uint32_t), 0);
+    heap_list_insert(blk);
 }
 
-void *kmalloc(size_t size) {
+static heap_free_t *heap_insert_free(uint8_t *blk);
+
+/* Take a free block of at least `need` bytes off its list; IRQs off */
+static heap_free_t *heap_find(uint32_t need) {
+    /* Head of the request's own class may fit; any larger class always does */
+    uint32_t c = heap_class(need);
+    heap_free_t *blk = heap_lists[c];
+    if (!blk || BLK_SIZE(blk) < need) {
+        uint32_t higher = (c + 1 < HEAP_CLASSES) ? heap_list_map & ~((2u << c) - 1) : 0;
+        if (higher) {
+            blk = heap_lists[__builtin_ctz(higher)];
+        } else {
+            /* Last resort before failing: walk the request's own class */
+            while (blk && BLK_SIZE(blk) < need) blk = blk->next;
+            if (!blk) return NULL;
+        }
+    }
+
+    heap_list_remove(blk);
+    return blk;
+}
+
+/*
+ * The free lists and tags are only touched with IRQs off, so kmalloc() and
+ * kfree() may be called from interrupts. Backing a block is done with them
+ * on, after the block is claimed.
+ */
+static void *heap_alloc(size_t size) {
     if (size == 0) return NULL;
 
-    size = (size + 3) & ~3;
-
-    heap_block_t *curr = heap_head;
-    while (curr) {
-        if (curr->is_free && curr->size >= size) {
-            if (curr->size > size + sizeof(heap_block_t) + 16) {
-                heap_block_t *new_block = (heap_block_t *)((uint8_t *)curr + sizeof(heap_block_t) + size);
-                new_block->size = curr->size - size - sizeof(heap_block_t);
-                new_block->is_free = true;
-                new_block->next = curr->next;
-                curr->next = new_block;
-                curr->size = size;
+    uint32_t need = (size + HEAP_OVERHEAD + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1);
+    if (need < HEAP_MIN_BLOCK) need = HEAP_MIN_BLOCK;
+    if (need < size) return NULL;
+
+    /*
+     * Claim the whole block before mapping: running short of frames there
+     * reclaims, and a slab shrinker kfree()ing a neighbour must not merge
+     * into a block that is off its free list.
+     */
+    uint32_t flags = irq_save();
+    heap_free_t *blk = heap_find(need);
+    uint32_t total = blk ? BLK_SIZE(blk) : 0;
+    if (blk) {
+        heap_set_tags(blk, total, HEAP_USED);
+        heap_used += total - HEAP_OVERHEAD;
+    }
+    irq_restore(flags);
+    if (!blk) return NULL;
+
+    bool split = total - need >= HEAP_MIN_BLOCK;
+    uint32_t end = (uint32_t)blk + (split ? need : total);
+
+    /*
+     * Back the new block, and the remainder's tags if we split. On failure
+     * the block goes back without a trim: the only pages worth returning
+     * are the few just mapped, and kmalloc() retries into them after
+     * shrinking, while a trim would scan the whole (mostly unbacked) block.
+     */
+    bool mapped = heap_map_range((uint32_t)blk, end + (split ? sizeof(heap_free_t) : 0));
+
+    flags = irq_save();
+    if (!mapped) {
+        heap_used -= total - HEAP_OVERHEAD;
+        heap_insert_free((uint8_t *)blk);
+    } else if (split) {
+        /* The remainder merges with anything freed meanwhile; nothing to trim */
+        heap_set_tags(blk, need, HEAP_USED);
+        heap_set_tags((uint8_t *)end, total - need, 0);
+        heap_used -= total - need;
+        heap_insert_free((uint8_t *)end);
+    }
+    irq_restore(flags);
+    if (!mapped) return NULL;
+
+    return (uint8_t *)blk + sizeof(uint32_t);
+}
+
+/* Merge a block with its free neighbours and list the result */
+static heap_free_t *heap_insert_free(uint8_t *blk) {
+    uint32_t size = BLK_SIZE(blk);
+
+    uint8_t *next = BLK_NEXT(blk);
+    if (!BLK_USED(next)) {
+        heap_list_remove((heap_free_t *)next);
+        size += BLK_SIZE(next);
+    }
+
+    uint32_t prev_tag = BLK_PREV_TAG(blk);
+    if (!(prev_tag & HEAP_USED)) {
+        blk -= prev_tag & ~(HEAP_ALIGN - 1);
+        heap_list_remove((heap_free_t *)blk);
+        size += BLK_SIZE(blk);
+    }
+
+    heap_set_tags(blk, size, 0);
+    heap_list_insert((heap_free_t *)blk);
+    return (heap_free_t *)blk;
+}
+
+static void heap_release(uint8_t *blk) {
+    uint32_t freed_start = (uint32_t)blk;
+    uint32_t freed_end = freed_start + BLK_SIZE(blk);
+    heap_used -= BLK_SIZE(blk) - HEAP_OVERHEAD;
+
+    blk = (uint8_t *)heap_insert_free(blk);
+    uint32_t size = BLK_SIZE(blk);
+    if (size < HEAP_TRIM) return;
+
+    /*
+     * Release whole pages strictly inside the merged block, keeping the ones
+     * holding its header/links and footer. Older parts of the block were
+     * trimmed when they were freed, so only look around the freed range and
+     * the neighbour tags it absorbed.
+     */
+    uint32_t lo = PAGE_UP((uint32_t)blk + sizeof(heap_free_t));
+    uint32_t hi = PAGE_DOWN((uint32_t)blk + size - sizeof(uint32_t));
+    uint32_t scan_lo = PAGE_DOWN(freed_start) - PAGE_SIZE;
+    uint32_t scan_hi = PAGE_UP(freed_end + sizeof(heap_free_t)) + PAGE_SIZE;
+    if (lo < scan_lo) lo = scan_lo;
+    if (hi > scan_hi) hi = scan_hi;
+    if (lo < hi) heap_unmap_range(lo, hi);
+}
+
+static uint32_t heap_hist_bucket(uint32_t size) {
+    uint32_t c = heap_class(size);
+    return c < HEAP_HIST_BUCKETS ? c : HEAP_HIST_BUCKETS - 1;
+}
+
+/* Site slot for a caller; a full table drops new callers */
+static heap_site_t *heap_site_for(uint32_t caller, bool create) {
+    heap_site_t *unused = NULL;
+    for (int i = 0; i < HEAP_SITES; i++) {
+        if (heap_sites[i].caller == caller) return &heap_sites[i];
+        if (!heap_sites[i].caller && !unused) unused = &heap_sites[i];
+    }
+    if (!create || !unused) return NULL;
+    unused->caller = caller;
+    return unused;
+}
+
+void *kmalloc(size_t size) {
+    uint64_t start = rdtsc();
+    bool track = heap_tracking && size;
+
+    size_t need = track ? size + sizeof(uint32_t) : size;
+    void *ptr = heap_alloc(need);
+    if (!ptr && size && pmm_shrink(need / PAGE_SIZE + 1)) ptr = heap_alloc(need);
+
+    uint32_t flags = irq_save();
+    if (ptr) {
+        uint8_t *blk = (uint8_t *)ptr - sizeof(uint32_t);
+        uint32_t blk_size = BLK_SIZE(blk);
+
+        heap_stats.live_hist[heap_hist_bucket(blk_size)]++;
+        if (heap_used > heap_stats.peak_used) heap_stats.peak_used = heap_used;
+
+        if (track) {
+            uint32_t caller = (uint32_t)__builtin_return_address(0);
+            *(uint32_t *)blk |= HEAP_TRACKED;
+            *(uint32_t *)(blk + blk_size - 2 * sizeof(uint32_t)) = caller;
+
+            heap_site_t *site = heap_site_for(caller, true);
+            if (site) {
+                site->live_allocs++;
+                site->live_bytes += blk_size - HEAP_OVERHEAD - sizeof(uint32_t);
             }
-            curr->is_free = false;
-            heap_used += curr->size;
-            return (void *)((uint8_t *)curr + sizeof(heap_block_t));
         }
-        curr = curr->next;
+    } else if (size) {
+        heap_stats.failed_allocs++;
     }
-    return NULL;
+
+    heap_stats.alloc_calls++;
+    heap_stats.alloc_cycles += rdtsc() - start;
+    irq_restore(flags);
+    return ptr;
 }
 
 void kfree(void *ptr) {
     if (!ptr) return;
 
-    heap_block_t *block = (heap_block_t *)((uint8_t *)ptr - sizeof(heap_block_t));
-    block->is_free = true;
-    heap_used -= block->size;
+    uint64_t start = rdtsc();
+    uint8_t *blk = (uint8_t *)ptr - sizeof(uint32_t);
+    uint32_t flags = irq_save();
+    if (!BLK_USED(blk)) {
+        irq_restore(flags);
+        return;
+    }
+
+    uint32_t blk_size = BLK_SIZE(blk);
+    heap_stats.live_hist[heap_hist_bucket(blk_size)]--;
 
-    heap_block_t *curr = heap_head;
-    while (curr) {
-        if (curr->is_free && curr->next && curr->next->is_free) {
-            curr->size += sizeof(heap_block_t) + curr->next->size;
-            curr->next = curr->next->next;
-            continue;
+    if (*(uint32_t *)blk & HEAP_TRACKED) {
+        uint32_t caller = *(uint32_t *)(blk + blk_size - 2 * sizeof(uint32_t));
+        heap_site_t *site = heap_site_for(caller, false);
+        if (site) {
+            site->live_allocs--;
+            site->live_bytes -= blk_size - HEAP_OVERHEAD - sizeof(uint32_t);
         }
-        curr = curr->next;
     }
+
+    heap_release(blk);
+
+    heap_stats.free_calls++;
+    heap_stats.free_cycles += rdtsc() - start;
+    irq_restore(flags);
 }
 
 uint32_t heap_get_used(void) {
     return heap_used;
 }
 
+/* What kmalloc could still hand out: unused backed bytes plus free RAM */
 uint32_t heap_get_free(void) {
-    return HEAP_SIZE - heap_used;
+    uint32_t avail = (heap_mapped - heap_used) + pmm_get_free_pages() * PAGE_SIZE;
+    if (avail > KHEAP_MAX - heap_used) avail = KHEAP_MAX - heap_used;
+    return avail;
+}
+
+uint32_t heap_get_mapped(void) {
+    return heap_mapped;
+}
+
+/*
+ * Counters plus a walk of the free lists for size and fragmentation. The
+ * free block running up to the epilogue is the never-used, mostly unbacked
+ * rest of the window; counting it would make the heap look one huge
+ * unfragmented block, so it is reported on its own.
+ */
+void heap_get_stats(heap_stats_t *stats) {
+    uint32_t flags = irq_save();
+    *stats = heap_stats;
+    stats->used = heap_used;
+    stats->free_bytes = 0;
+    stats->free_blocks = 0;
+    stats->largest_free = 0;
+    stats->wilderness = 0;
+
+    uint32_t epilogue = KHEAP_BASE + KHEAP_MAX - sizeof(uint32_t);
+    for (uint32_t c = 0; c < HEAP_CLASSES; c++) {
+        for (heap_free_t *blk = heap_lists[c]; blk; blk = blk->next) {
+            uint32_t size = BLK_SIZE(blk);
+            if ((uint32_t)blk + size == epilogue) {
+                stats->wilderness = size;
+                continue;
+            }
+            stats->free_bytes += size;
+            stats->free_blocks++;
+            if (size > stats->largest_free) stats->largest_free = size;
+        }
+    }
+    irq_restore(flags);
+
+    uint32_t scattered = stats->free_bytes - stats->largest_free;
+    stats->frag_percent = stats->free_bytes >= 100 ? scattered / (stats->free_bytes / 100) : 0;
+}
+
+void heap_track_callers(bool enable) {
+    heap_tracking = enable;
+}
+
+bool heap_tracking_callers(void) {
+    return heap_tracking;
+}
+
+const heap_site_t *heap_get_sites(void) {
+    return heap_sites;
 }
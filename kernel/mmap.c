@@ -0,0 +1,248 @@
+#include "mmap.h"
+#include "memory.h"
+#include "fat.h"
+#include "string.h"
+#include "io.h"
+
+/*
+ * File mappings. A region only records which file backs an address range;
+ * pages are read when first touched, by the page-fault handler, through
+ * the file page cache below. Kernel regions (dir 0) live in the KMMAP
+ * window and are visible from every address space; user regions belong
+ * to one page directory. The file's cluster chain is resolved into runs
+ * when it is mapped, so a fault indexes into them instead of walking the
+ * FAT from the first cluster.
+ */
+typedef struct {
+    uint32_t dir;
+    uint32_t start;
+    uint32_t end;
+    uint32_t file_size;
+    uint16_t cluster;
+    uint8_t  flags;
+    bool     used;
+    fat_run_t *runs;        /* kmalloc'd, one copy per region */
+    int        run_count;
+} mmap_region_t;
+
+/*
+ * File page cache, keyed by (first cluster, page index). The cache holds
+ * one PMM reference on each page and every mapping another, so a clean
+ * page is read once and shared by all mappers. Pages only the cache still
+ * references are recycled when a slot is needed.
+ */
+#define FILE_CACHE_PAGES 64
+
+typedef struct {
+    uint32_t phys;           /* 0: empty slot */
+    uint32_t index;
+    uint16_t cluster;
+} file_page_t;
+
+static mmap_region_t regions[MMAP_MAX_REGIONS];
+static file_page_t file_cache[FILE_CACHE_PAGES];
+
+/* A page of a region's file, with one reference for the caller */
+static uint32_t file_page_get(const mmap_region_t *r, uint32_t index) {
+    uint16_t cluster = r->cluster;
+    file_page_t *slot = NULL;
+
+    for (int i = 0; i < FILE_CACHE_PAGES; i++) {
+        file_page_t *p = &file_cache[i];
+        if (p->phys && p->cluster == cluster && p->index == index) {
+            pmm_page_get(p->phys / PAGE_SIZE);
+            return p->phys;
+        }
+        if (!slot && (!p->phys || pmm_page_refs(p->phys / PAGE_SIZE) == 1)) slot = p;
+    }
+
+    uint8_t *page = (uint8_t *)pmm_alloc_page();
+    if (!page) return 0;
+
+    /* Straight from disk into the page; clear whatever lies past EOF */
+    uint32_t offset = index * PAGE_SIZE;
+    int got = fat_read_runs(r->runs, r->run_count, offset, page, PAGE_SIZE);
+    if (got < 0) {
+        pmm_free_page(page);
+        return 0;
+    }
+    uint32_t valid = r->file_size - offset;
+    if (valid > (uint32_t)got) valid = got;
+    if (valid < PAGE_SIZE) memset(page + valid, 0, PAGE_SIZE - valid);
+
+    if (slot) {
+        if (slot->phys) pmm_page_put(slot->phys / PAGE_SIZE);
+        slot->phys = (uint32_t)page;
+        slot->cluster = cluster;
+        slot->index = index;
+        pmm_page_get((uint32_t)page / PAGE_SIZE);
+    }
+    return (uint32_t)page;
+}
+
+/* Shrinker: drop cached pages no mapping uses any more */
+static uint32_t file_cache_shrink(uint32_t pages) {
+    uint32_t freed = 0;
+    for (int i = 0; i < FILE_CACHE_PAGES && freed < pages; i++) {
+        file_page_t *p = &file_cache[i];
+        if (!p->phys || pmm_page_refs(p->phys / PAGE_SIZE) != 1) continue;
+        pmm_page_put(p->phys / PAGE_SIZE);
+        p->phys = 0;
+        freed++;
+    }
+    return freed;
+}
+
+void mmap_init(void) {
+    pmm_register_shrinker("file cache", file_cache_shrink, SHRINK_PRIO_CACHE);
+}
+
+static bool is_kernel_addr(uint32_t addr) {
+    return addr >= KMMAP_BASE && addr - KMMAP_BASE < KMMAP_AREA;
+}
+
+static mmap_region_t *region_find(uint32_t dir, uint32_t addr) {
+    uint32_t owner = is_kernel_addr(addr) ? 0 : dir;
+
+    for (int i = 0; i < MMAP_MAX_REGIONS; i++) {
+        mmap_region_t *r = &regions[i];
+        if (r->used && r->dir == owner && addr >= r->start && addr < r->end) return r;
+    }
+    return NULL;
+}
+
+static mmap_region_t *region_alloc(void) {
+    for (int i = 0; i < MMAP_MAX_REGIONS; i++) {
+        if (!regions[i].used) return &regions[i];
+    }
+    return NULL;
+}
+
+static void region_free(mmap_region_t *r) {
+    kfree(r->runs);
+    r->runs = NULL;
+    r->used = false;
+}
+
+/* First fit in [base, limit), one unmapped page between neighbours */
+static uint32_t region_place(uint32_t owner, uint32_t base, uint32_t limit, uint32_t size) {
+    uint32_t start = base;
+
+    for (int i = 0; i < MMAP_MAX_REGIONS; i++) {
+        mmap_region_t *r = &regions[i];
+        if (r->used && r->dir == owner && r->start < start + size && start < r->end) {
+            start = r->end + PAGE_SIZE;
+            i = -1;
+        }
+    }
+    return (start + size > start && start + size <= limit) ? start : 0;
+}
+
+uint32_t mmap_map_file(uint32_t dir, const char *filename, uint32_t flags, uint32_t *size) {
+    fat_dir_entry_t entry;
+    if (!fat_lookup(filename, &entry) || entry.size == 0) return 0;
+
+    bool kernel = dir == paging_kernel_dir();
+    if (kernel && (flags & MMAP_WRITE)) return 0;
+
+    mmap_region_t *r = region_alloc();
+    if (!r) return 0;
+
+    int run_count = fat_chain_runs(entry.first_cluster, NULL, 0);
+    if (run_count <= 0) return 0;
+
+    uint32_t owner = kernel ? 0 : dir;
+    uint32_t length = (entry.size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    uint32_t start = kernel
+        ? region_place(owner, KMMAP_BASE, KMMAP_BASE + KMMAP_AREA, length)
+        : region_place(owner, USER_BASE, USER_STACK_TOP - USER_STACK_MAX - PAGE_SIZE, length);
+    if (!start) return 0;
+
+    fat_run_t *runs = (fat_run_t *)kmalloc(run_count * sizeof(fat_run_t));
+    if (!runs) return 0;
+    if (fat_chain_runs(entry.first_cluster, runs, run_count) != run_count) {
+        kfree(runs);
+        return 0;
+    }
+
+    r->dir = owner;
+    r->start = start;
+    r->end = start + length;
+    r->file_size = entry.size;
+    r->cluster = entry.first_cluster;
+    r->flags = flags;
+    r->runs = runs;
+    r->run_count = run_count;
+    r->used = true;
+
+    if (size) *size = entry.size;
+    return start;
+}
+
+bool mmap_unmap(uint32_t dir, uint32_t addr) {
+    mmap_region_t *r = region_find(dir, addr);
+    if (!r || r->start != addr) return false;
+
+    paging_batch_begin();
+    for (uint32_t v = r->start; v < r->end; v += PAGE_SIZE) {
+        uint32_t pfn;
+        if (r->dir) {
+            pfn = paging_unmap_user(dir, v);
+        } else {
+            uint32_t phys = paging_get_phys(v);
+            if (phys) paging_unmap_region(v, PAGE_SIZE);
+            pfn = phys / PAGE_SIZE;
+        }
+        if (pfn) pmm_page_put(pfn);
+    }
+    paging_batch_end();
+
+    region_free(r);
+    return true;
+}
+
+/*
+ * Fill a not-present page of a mapped file. Private writable user mappings
+ * get the cached page read-only with PG_COW, so the first write copies it.
+ */
+bool mmap_handle_fault(uint32_t addr, uint32_t err) {
+    if (err & PF_PRESENT) return false;
+
+    uint32_t dir = read_cr3();
+    mmap_region_t *r = region_find(dir, addr);
+    if (!r) return false;
+
+    uint32_t page_va = addr & ~(PAGE_SIZE - 1);
+    uint32_t phys = file_page_get(r, (page_va - r->start) / PAGE_SIZE);
+    if (!phys) return false;
+
+    bool ok = r->dir
+        ? paging_map_user(dir, page_va, phys / PAGE_SIZE, (r->flags & MMAP_WRITE) ? PG_COW : 0)
+        : paging_map_region(page_va, phys, PAGE_SIZE, PG_PRESENT, PAGE_CACHE_WB);
+    if (!ok) pmm_page_put(phys / PAGE_SIZE);
+    return ok;
+}
+
+bool mmap_clone_space(uint32_t src, uint32_t dst) {
+    for (int i = 0; i < MMAP_MAX_REGIONS; i++) {
+        if (!regions[i].used || regions[i].dir != src) continue;
+
+        mmap_region_t *copy = region_alloc();
+        fat_run_t *runs = copy ? (fat_run_t *)kmalloc(regions[i].run_count * sizeof(fat_run_t)) : NULL;
+        if (!runs) {
+            mmap_release_space(dst);
+            return false;
+        }
+        *copy = regions[i];
+        copy->dir = dst;
+        copy->runs = runs;
+        memcpy(runs, regions[i].runs, copy->run_count * sizeof(fat_run_t));
+    }
+    return true;
+}
+
+void mmap_release_space(uint32_t dir) {
+    for (int i = 0; i < MMAP_MAX_REGIONS; i++) {
+        if (regions[i].used && regions[i].dir == dir && dir) region_free(&regions[i]);
+    }
+}
@@ -5,46 +5,304 @@
 #include "io.h"
 #include "vga.h"
 #include "gdt.h"
-
-static process_t processes[MAX_PROCESSES];
-static int current_pid = -1;
+#include "mmap.h"
+#include "slab.h"
+#include "fpu.h"
+
+/*
+ * Process table. PCBs come from a slab cache and live tasks are chained on
+ * an intrusive list, so nothing scales with the table's capacity. PIDs come
+ * from a bitmap and map back to their PCB through pid_table; a PID also
+ * picks the task's kernel stack window, which bounds them by PID_LIMIT. A
+ * PID is only released when its task is reaped.
+ */
+static kmem_cache_t *pcb_cache = NULL;
+static process_t *pid_table[PID_LIMIT];
+static uint32_t pid_map[PID_LIMIT / 32];
+static uint32_t pid_hint = 0;
+static process_t *task_list = NULL;
+static process_t *task_tail = NULL;
+static uint32_t task_count = 0;
+
+static process_t *current = NULL;
 static bool mt_enabled = false;
 
+/*
+ * O(1) run queues. Each array has a FIFO per priority and a bitmap of the
+ * non-empty ones, so the next task is the head of list ctz(bitmap). A task
+ * that uses up its slice goes to the expired array; when the active one
+ * runs dry the two swap roles and everyone starts a fresh round. So higher
+ * priorities always go first within a round, but can't starve lower ones.
+ * The running task is never on a queue.
+ */
+typedef struct {
+    uint32_t bitmap;
+    process_t *head[PRIO_LEVELS];
+    process_t *tail[PRIO_LEVELS];
+} run_array_t;
+
+static const uint8_t prio_slices[PRIO_LEVELS] = { 16, 12, 10, 8, 6, 4, 3, 2 };
+
+static run_array_t run_arrays[2];
+static uint8_t active = 0;
+static process_t *zombies = NULL;
+
+/*
+ * Runs only when every other task is blocked, and is never queued. It
+ * does the PMM's background work, then halts with the tick stopped until
+ * the next interrupt or timer.
+ */
+static process_t *idle_task = NULL;
+static bool need_resched = false;
+
 extern void task_start_wrapper(void);
 extern void user_mode_enter(void);
+extern void isr_return(void);
+
+/* Bounds of the user program's pages, from linker.ld */
+extern uint8_t __user_start[], __user_end[];
+
+/*
+ * Every task's kernel stack lives in its own KSTACK_SLOT window at
+ * KSTACK_BASE. Only the top KSTACK_SIZE is backed; the rest of the window
+ * stays unmapped as a guard, so an overflow faults instead of running into
+ * the neighbouring task. Ring 0 can't take a page fault on its own stack,
+ * so unlike user stacks these are backed up front.
+ */
+static void kstack_destroy_range(uint32_t start, uint32_t end) {
+    paging_batch_begin();
+    for (uint32_t v = start; v < end; v += PAGE_SIZE) {
+        uint32_t phys = paging_get_phys(v);
+        if (!phys) continue;
+        paging_unmap_region(v, PAGE_SIZE);
+        pmm_free_page((void *)phys);
+    }
+    paging_batch_end();
+}
 
-void multitasking_init(void) {
-    memset(processes, 0, sizeof(processes));
+static uint32_t kstack_create(uint32_t pid) {
+    uint32_t top = KSTACK_BASE + (pid + 1) * KSTACK_SLOT;
 
-    processes[0].pid = 0;
-    processes[0].state = PROC_RUNNING;
-    processes[0].name = "kernel";
-    processes[0].esp = 0;
-    processes[0].stack_base = 0;
+    for (uint32_t v = top - KSTACK_SIZE; v < top; v += PAGE_SIZE) {
+        void *page = pmm_alloc_page();
+        if (!page || !paging_map_region(v, (uint32_t)page, PAGE_SIZE, 0x03, PAGE_CACHE_WB)) {
+            if (page) pmm_free_page(page);
+            kstack_destroy_range(top - KSTACK_SIZE, v);
+            return 0;
+        }
+    }
+    return top;
+}
 
-    current_pid = 0;
-    mt_enabled = true;
+/* Lowest free PID at or after the hint, wrapping; -1 when all are taken */
+static int pid_alloc(void) {
+    for (uint32_t n = 0; n < PID_LIMIT / 32; n++) {
+        uint32_t w = (pid_hint / 32 + n) % (PID_LIMIT / 32);
+        if (pid_map[w] == 0xFFFFFFFF) continue;
 
-    timer_set_scheduler(schedule);
+        uint32_t bit = __builtin_ctz(~pid_map[w]);
+        pid_map[w] |= 1u << bit;
+        pid_hint = w * 32 + bit + 1;
+        return w * 32 + bit;
+    }
+    return -1;
 }
 
-int process_create(void (*entry)(void), const char *name) {
-    int pid = -1;
-    for (int i = 1; i < MAX_PROCESSES; i++) {
-        if (processes[i].state == PROC_UNUSED) {
-            pid = i;
-            break;
-        }
+static void pid_free(uint32_t pid) {
+    pid_map[pid / 32] &= ~(1u << (pid % 32));
+    pid_table[pid] = NULL;
+}
+
+static bool reap_zombie(void);
+
+/* A blank PCB with a PID and a kernel stack, not yet on any list */
+static process_t *process_alloc(void) {
+    while (reap_zombie()) {}
+
+    uint32_t flags = irq_save();
+    int pid = pid_alloc();
+    irq_restore(flags);
+    if (pid < 0) return NULL;
+
+    process_t *p = (process_t *)kmem_cache_alloc(pcb_cache);
+    uint32_t stack_top = p ? kstack_create(pid) : 0;
+    if (!stack_top) {
+        if (p) kmem_cache_free(pcb_cache, p);
+        flags = irq_save();
+        pid_free(pid);
+        irq_restore(flags);
+        return NULL;
+    }
+
+    memset(p, 0, sizeof(process_t));
+    p->pid = pid;
+    p->kernel_stack = stack_top - KSTACK_SIZE;
+    p->kernel_stack_top = stack_top;
+    pid_table[pid] = p;
+    return p;
+}
+
+/* Undo process_alloc() for a task that never ran */
+static void process_free(process_t *p) {
+    fpu_release(p);
+    kstack_destroy_range(p->kernel_stack, p->kernel_stack_top);
+    uint32_t flags = irq_save();
+    pid_free(p->pid);
+    irq_restore(flags);
+    kmem_cache_free(pcb_cache, p);
+}
+
+static void rq_push(uint8_t array, process_t *p) {
+    run_array_t *a = &run_arrays[array];
+    uint8_t prio = p->priority;
+
+    p->queue = array;
+    p->rq_next = NULL;
+    p->rq_prev = a->tail[prio];
+    if (a->tail[prio]) a->tail[prio]->rq_next = p;
+    else a->head[prio] = p;
+    a->tail[prio] = p;
+    a->bitmap |= 1u << prio;
+}
+
+static void rq_remove(process_t *p) {
+    run_array_t *a = &run_arrays[p->queue];
+    uint8_t prio = p->priority;
+
+    if (p->rq_prev) p->rq_prev->rq_next = p->rq_next;
+    else a->head[prio] = p->rq_next;
+    if (p->rq_next) p->rq_next->rq_prev = p->rq_prev;
+    else a->tail[prio] = p->rq_prev;
+    if (!a->head[prio]) a->bitmap &= ~(1u << prio);
+    p->rq_next = p->rq_prev = NULL;
+}
+
+static process_t *rq_pop(void) {
+    if (!run_arrays[active].bitmap) active ^= 1;
+    run_array_t *a = &run_arrays[active];
+    if (!a->bitmap) return NULL;
+
+    process_t *p = a->head[__builtin_ctz(a->bitmap)];
+    rq_remove(p);
+    return p;
+}
+
+static void scheduler_tick(void);
+
+/* Back on a queue: this round if it has slice left, else the next one */
+static void rq_requeue(process_t *p) {
+    if (p->slice) {
+        rq_push(active, p);
+    } else {
+        p->slice = prio_slices[p->priority];
+        rq_push(active ^ 1, p);
+    }
+}
+
+/* Publish a new task and queue it: fresh slice, this round */
+static void process_make_ready(process_t *p, uint8_t priority) {
+    p->priority = priority;
+    p->slice = prio_slices[priority];
+    p->state = PROC_READY;
+
+    uint32_t flags = irq_save();
+    p->task_prev = task_tail;
+    if (task_tail) task_tail->task_next = p;
+    else task_list = p;
+    task_tail = p;
+    task_count++;
+    rq_push(active, p);
+    irq_restore(flags);
+}
+
+static void idle_main(void) {
+    for (;;) {
+        if (reap_zombie() || pmm_idle()) continue;
+
+        /* Nothing to do: go tickless, and sti; hlt so no wakeup slips by */
+        cli();
+        timer_nohz_enter();
+        __asm__ volatile("sti; hlt");
+    }
+}
+
+void multitasking_init(void) {
+    memset(pid_table, 0, sizeof(pid_table));
+    memset(pid_map, 0, sizeof(pid_map));
+    memset(run_arrays, 0, sizeof(run_arrays));
+    active = 0;
+    zombies = NULL;
+
+    pcb_cache = kmem_cache_create("pcb", sizeof(process_t), NULL);
+    if (!pcb_cache) return;
+
+    /* PID 0 is the boot thread, already running on the boot stack */
+    process_t *kernel = (process_t *)kmem_cache_alloc(pcb_cache);
+    if (!kernel) return;
+    memset(kernel, 0, sizeof(process_t));
+    pid_map[0] = 1;
+    pid_table[0] = kernel;
+    pid_hint = 1;
+
+    kernel->state = PROC_RUNNING;
+    kernel->name = "kernel";
+    kernel->page_dir = paging_kernel_dir();
+    kernel->priority = PRIO_INTERACTIVE;
+    kernel->slice = prio_slices[PRIO_INTERACTIVE];
+    task_list = task_tail = kernel;
+    task_count = 1;
+    current = kernel;
+
+    int idle_pid = process_create(idle_main, "idle");
+    if (idle_pid > 0) {
+        idle_task = pid_table[idle_pid];
+        rq_remove(idle_task);
+        idle_task->priority = PRIO_LEVELS - 1;
     }
-    if (pid == -1) return -1;
 
-    void *stack = pmm_alloc_page();
-    if (!stack) return -1;
-    memset(stack, 0, PROCESS_STACK_SIZE);
+    paging_expose_to_user((uint32_t)__user_start, (uint32_t)__user_end);
 
-    uint32_t stack_top = (uint32_t)stack + PROCESS_STACK_SIZE;
+    mt_enabled = true;
+
+    timer_set_scheduler(scheduler_tick);
+}
+
+/*
+ * Free one exited task; false if there are none. Runs in task context (the
+ * idle loop, and before each new task is set up), never from schedule():
+ * releasing the stack, FPU area, mappings and PCB goes through the heap and
+ * slab, and an interrupt must not re-enter those.
+ */
+static bool reap_zombie(void) {
+    uint32_t flags = irq_save();
+    process_t *p = zombies;
+    if (p) zombies = p->rq_next;
+    irq_restore(flags);
+    if (!p) return false;
+
+    fpu_release(p);
+    kstack_destroy_range(p->kernel_stack, p->kernel_stack_top);
+    mmap_release_space(p->page_dir);
+    paging_destroy_space(p->page_dir);
+
+    flags = irq_save();
+    if (p->task_prev) p->task_prev->task_next = p->task_next;
+    else task_list = p->task_next;
+    if (p->task_next) p->task_next->task_prev = p->task_prev;
+    else task_tail = p->task_prev;
+    task_count--;
+    pid_free(p->pid);
+    irq_restore(flags);
+
+    kmem_cache_free(pcb_cache, p);
+    return true;
+}
+
+int process_create(void (*entry)(void), const char *name) {
+    process_t *p = process_alloc();
+    if (!p) return -1;
 
-    uint32_t *sp = (uint32_t *)stack_top;
+    uint32_t *sp = (uint32_t *)p->kernel_stack_top;
     *(--sp) = (uint32_t)process_exit;
     *(--sp) = (uint32_t)entry;
     *(--sp) = (uint32_t)task_start_wrapper;
@@ -53,44 +311,30 @@ int process_create(void (*entry)(void), const char *name) {
     *(--sp) = 0;
     *(--sp) = 0;
 
-    processes[pid].pid = pid;
-    processes[pid].esp = (uint32_t)sp;
-    processes[pid].stack_base = (uint32_t)stack;
-    processes[pid].is_user = false;
-    processes[pid].state = PROC_READY;
-    processes[pid].name = name;
+    p->esp = (uint32_t)sp;
+    p->page_dir = paging_kernel_dir();
+    p->is_user = false;
+    p->name = name;
+    process_make_ready(p, PRIO_DEFAULT);
 
-    return pid;
+    return p->pid;
 }
 
 int process_create_user(void (*entry)(void), const char *name) {
-    int pid = -1;
-    for (int i = 1; i < MAX_PROCESSES; i++) {
-        if (processes[i].state == PROC_UNUSED) {
-            pid = i;
-            break;
-        }
-    }
-    if (pid == -1) return -1;
-
-    void *user_stack = pmm_alloc_page();
-    if (!user_stack) return -1;
-    memset(user_stack, 0, PROCESS_STACK_SIZE);
+    process_t *p = process_alloc();
+    if (!p) return -1;
 
-    void *kernel_stack = pmm_alloc_page();
-    if (!kernel_stack) {
-        pmm_free_page(user_stack);
+    /* The user stack is left unbacked; the first push faults it in */
+    uint32_t page_dir = paging_create_space();
+    if (!page_dir) {
+        process_free(p);
         return -1;
     }
-    memset(kernel_stack, 0, PROCESS_STACK_SIZE);
 
-    uint32_t user_stack_top = (uint32_t)user_stack + PROCESS_STACK_SIZE;
-    uint32_t kernel_stack_top = (uint32_t)kernel_stack + PROCESS_STACK_SIZE;
-
-    uint32_t *sp = (uint32_t *)kernel_stack_top;
+    uint32_t *sp = (uint32_t *)p->kernel_stack_top;
 
     *(--sp) = GDT_USER_DATA | 0x03;
-    *(--sp) = user_stack_top;
+    *(--sp) = USER_STACK_TOP;
     *(--sp) = 0x202;
     *(--sp) = GDT_USER_CODE | 0x03;
     *(--sp) = (uint32_t)entry;
@@ -101,80 +345,243 @@ int process_create_user(void (*entry)(void), const char *name) {
     *(--sp) = 0;
     *(--sp) = 0;
 
-    processes[pid].pid = pid;
-    processes[pid].esp = (uint32_t)sp;
-    processes[pid].stack_base = (uint32_t)user_stack;
-    processes[pid].kernel_stack = (uint32_t)kernel_stack;
-    processes[pid].kernel_stack_top = kernel_stack_top;
-    processes[pid].is_user = true;
-    processes[pid].state = PROC_READY;
-    processes[pid].name = name;
+    p->esp = (uint32_t)sp;
+    p->page_dir = page_dir;
+    p->is_user = true;
+    p->name = name;
+    process_make_ready(p, PRIO_DEFAULT);
+
+    return p->pid;
+}
+
+/*
+ * Duplicate the calling user process. The child gets a copy-on-write clone
+ * of the address space and a kernel stack holding a copy of the parent's
+ * syscall frame, so it resumes from the same int 0x80 with eax = 0.
+ */
+int process_fork(registers_t *regs) {
+    if (!current || !current->is_user) return -1;
+
+    process_t *p = process_alloc();
+    if (!p) return -1;
+
+    uint32_t page_dir = paging_clone_space(current->page_dir);
+    if (!page_dir || !mmap_clone_space(current->page_dir, page_dir) || !fpu_fork(current, p)) {
+        if (page_dir) {
+            mmap_release_space(page_dir);
+            paging_destroy_space(page_dir);
+        }
+        process_free(p);
+        return -1;
+    }
+
+    registers_t *frame = (registers_t *)p->kernel_stack_top - 1;
+    *frame = *regs;
+    frame->eax = 0;
+
+    uint32_t *sp = (uint32_t *)frame;
+    *(--sp) = (uint32_t)isr_return;
+    *(--sp) = 0;
+    *(--sp) = 0;
+    *(--sp) = 0;
+    *(--sp) = 0;
+
+    p->esp = (uint32_t)sp;
+    p->page_dir = page_dir;
+    p->is_user = true;
+    p->name = current->name;
+    process_make_ready(p, current->priority);
 
-    return pid;
+    return p->pid;
 }
 
+/*
+ * Switch to the most urgent ready task. The caller goes back on a queue if
+ * it can still run: the active array if it has slice left, otherwise the
+ * expired one with its slice refilled. With nothing else ready it simply
+ * keeps the CPU.
+ */
 void schedule(void) {
-    if (!mt_enabled || current_pid < 0) return;
+    if (!mt_enabled) return;
 
-    int next = current_pid;
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-        next = (next + 1) % MAX_PROCESSES;
-        if (processes[next].state == PROC_READY) {
-            break;
-        }
+    uint32_t flags = irq_save();
+    process_t *prev = current;
+
+    if (prev->state == PROC_RUNNING) {
+        prev->state = PROC_READY;
+        if (prev != idle_task) rq_requeue(prev);
     }
 
-    if (next == current_pid) return;
-    if (processes[next].state != PROC_READY) return;
+    need_resched = false;
+    process_t *next = rq_pop();
+    if (!next) next = idle_task;
+    if (!next) {
+        /* No idle task: keep going on the caller, blocked or not */
+        prev->state = PROC_RUNNING;
+        irq_restore(flags);
+        return;
+    }
+
+    next->state = PROC_RUNNING;
+    current = next;
+    if (next != prev) {
+        if (next->is_user) tss_set_kernel_stack(next->kernel_stack_top);
+        paging_switch(next->page_dir);
+        prev->tlb_batch = paging_batch_switch(next->tlb_batch);
+        fpu_switch(next);
+        context_switch(&prev->esp, next->esp);
+    }
+    irq_restore(flags);
+}
+
+/* Make a blocked task runnable again, off whatever it was waiting on */
+static void process_wake(process_t *p) {
+    if (p->state != PROC_BLOCKED) return;
+
+    if (p->waiting_on) {
+        wait_queue_t *wq = p->waiting_on;
+        if (p->rq_prev) p->rq_prev->rq_next = p->rq_next;
+        else wq->head = p->rq_next;
+        if (p->rq_next) p->rq_next->rq_prev = p->rq_prev;
+        else wq->tail = p->rq_prev;
+        p->waiting_on = NULL;
+    }
+    timer_cancel(&p->sleep_timer);
+
+    p->state = PROC_READY;
+    rq_requeue(p);
+
+    if (current == idle_task || p->priority < current->priority) need_resched = true;
+}
+
+/* Timer callback for a timed wait that ran out */
+static void sleep_timeout(void *arg) {
+    process_t *p = (process_t *)arg;
+    p->timed_out = true;
+    process_wake(p);
+}
+
+/* Timer hook: charge the tick, switch when outranked */
+static void scheduler_tick(void) {
+    if (!mt_enabled) return;
+
+    process_t *cur = current;
+    if (cur->slice && cur != idle_task) cur->slice--;
 
-    int old_pid = current_pid;
-    current_pid = next;
+    uint32_t more_urgent = run_arrays[active].bitmap & ((1u << cur->priority) - 1);
+    if (!cur->slice || more_urgent || need_resched) schedule();
+}
+
+void process_preempt(void) {
+    if (need_resched && mt_enabled) schedule();
+}
+
+bool sleep_on_timeout(wait_queue_t *wq, uint32_t ticks) {
+    uint32_t flags = irq_save();
 
-    processes[old_pid].state = (processes[old_pid].state == PROC_RUNNING)
-                                ? PROC_READY : processes[old_pid].state;
-    processes[next].state = PROC_RUNNING;
+    /* Before multitasking there is nothing else to run: just wait for an IRQ */
+    if (!mt_enabled) {
+        __asm__ volatile("sti; hlt; cli");
+        irq_restore(flags);
+        return true;
+    }
+
+    process_t *p = current;
+    p->state = PROC_BLOCKED;
+    p->timed_out = false;
+
+    if (wq) {
+        p->waiting_on = wq;
+        p->rq_next = NULL;
+        p->rq_prev = wq->tail;
+        if (wq->tail) wq->tail->rq_next = p;
+        else wq->head = p;
+        wq->tail = p;
+    }
 
-    if (processes[next].is_user) {
-        tss_set_kernel_stack(processes[next].kernel_stack_top);
+    if (ticks) {
+        timer_setup(&p->sleep_timer, sleep_timeout, p);
+        timer_add(&p->sleep_timer, timer_get_ticks() + ticks);
     }
 
-    context_switch(&processes[old_pid].esp, processes[next].esp);
+    schedule();
+
+    bool woken = !p->timed_out;
+    irq_restore(flags);
+    return woken;
 }
 
-void process_exit(void) {
-    if (current_pid > 0) {
-        processes[current_pid].state = PROC_TERMINATED;
+void sleep_on(wait_queue_t *wq) {
+    sleep_on_timeout(wq, 0);
+}
 
-        if (processes[current_pid].stack_base) {
-            pmm_free_page((void *)processes[current_pid].stack_base);
-        }
-        if (processes[current_pid].kernel_stack) {
-            pmm_free_page((void *)processes[current_pid].kernel_stack);
-        }
+void sleep_ticks(uint32_t ticks) {
+    if (ticks) sleep_on_timeout(NULL, ticks);
+}
+
+void wake_up(wait_queue_t *wq) {
+    uint32_t flags = irq_save();
+    while (wq->head) process_wake(wq->head);
+    irq_restore(flags);
+}
 
-        processes[current_pid].state = PROC_UNUSED;
+int process_set_priority(uint32_t pid, uint32_t priority) {
+    process_t *p = process_find(pid);
+    if (!p || p == idle_task || priority >= PRIO_LEVELS || p->state == PROC_TERMINATED) return -1;
+
+    uint32_t flags = irq_save();
+    int old = p->priority;
+    if (p->state == PROC_READY) {
+        uint8_t array = p->queue;
+        rq_remove(p);
+        p->priority = priority;
+        rq_push(array, p);
+    } else {
+        p->priority = priority;
+    }
+    if (p->slice > prio_slices[priority]) p->slice = prio_slices[priority];
+    irq_restore(flags);
+    return old;
+}
+
+/*
+ * The exiting task is still running on its kernel stack and address space,
+ * so it only marks itself terminated and joins the zombie list, keeping
+ * IRQs off until it is switched away; the idle loop, or the next task
+ * creation, reaps it.
+ */
+void process_exit(void) {
+    if (current && current->pid > 0) {
+        cli();
+        process_t *p = current;
+        p->state = PROC_TERMINATED;
+        p->rq_next = zombies;
+        zombies = p;
     }
 
     schedule();
     for (;;) hlt();
 }
 
+/* Live tasks, exited ones not yet reaped included */
 int process_count(void) {
-    int count = 0;
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-        if (processes[i].state == PROC_READY || processes[i].state == PROC_RUNNING) {
-            count++;
-        }
-    }
-    return count;
+    return task_count;
+}
+
+process_t *process_first(void) {
+    return task_list;
+}
+
+process_t *process_find(uint32_t pid) {
+    return pid < PID_LIMIT ? pid_table[pid] : NULL;
 }
 
-process_t *process_get_list(void) {
-    return processes;
+process_t *process_current(void) {
+    return current;
 }
 
 uint32_t process_current_pid(void) {
-    return (current_pid >= 0) ? (uint32_t)current_pid : 0;
+    return current ? current->pid : 0;
 }
 
 bool multitasking_enabled(void) {
@@ -3,10 +3,15 @@
 #include "keyboard.h"
 #include "string.h"
 #include "memory.h"
+#include "slab.h"
 #include "fat.h"
+#include "mmap.h"
+#include "swap.h"
 #include "process.h"
 #include "idt.h"
 #include "io.h"
+#include "div64.h"
+#include "clock.h"
 
 #define CMD_BUF_SIZE 256
 #define MAX_ARGS     16
@@ -24,12 +29,15 @@ static void cmd_help(void) {
     terminal_print("  clear    - Clear the screen\n");
     terminal_print("  reboot   - Reboot the system\n");
     terminal_print("  meminfo  - Show memory information\n");
+    terminal_print("             ('meminfo track' toggles kmalloc caller tracking)\n");
     terminal_print("  echo     - Print text to screen\n");
     terminal_print("  ls       - List files on disk\n");
     terminal_print("  cat      - Display file contents\n");
     terminal_print("  tasks    - Show running processes\n");
+    terminal_print("  nice     - Set a task's priority: nice <pid> <0-7>\n");
     terminal_print("  demo     - Start multitasking demo\n");
     terminal_print("  uname    - Show system info\n");
+    terminal_print("  uptime   - Show time since boot\n");
 }
 
 static void cmd_clear(void) {
@@ -45,22 +53,76 @@ static void cmd_reboot(void) {
     for (;;) hlt();
 }
 
-static void cmd_meminfo(void) {
+static uint32_t avg_cycles(uint64_t cycles, uint32_t calls) {
+    return calls ? (uint32_t)div64_u32(cycles, calls) : 0;
+}
+
+static void cmd_meminfo(const char *args) {
+    if (args && strcmp(args, "track") == 0) {
+        heap_track_callers(!heap_tracking_callers());
+        terminal_printf("kmalloc caller tracking %s\n", heap_tracking_callers() ? "on" : "off");
+        return;
+    }
+
+    heap_stats_t hs;
+    heap_get_stats(&hs);
+
     terminal_print_colored("Memory Information:\n", VGA_LIGHT_CYAN, VGA_BLACK);
-    terminal_printf("  Physical pages: %d total, %d free (%d KB free)\n",
+    terminal_printf("  Physical pages: %d total, %d free (%d KB free), peak %d used\n",
         pmm_get_total_pages(), pmm_get_free_pages(),
-        pmm_get_free_pages() * 4);
-    terminal_printf("  Heap: %d bytes used, %d bytes free\n",
-        heap_get_used(), heap_get_free());
-
-    /* Quick kmalloc/kfree test */
-    void *p = kmalloc(128);
-    if (p) {
-        terminal_printf("  Alloc test: kmalloc(128) = %x ", (uint32_t)p);
-        kfree(p);
-        terminal_print_colored("[OK]\n", VGA_LIGHT_GREEN, VGA_BLACK);
-    } else {
-        terminal_print_colored("  Alloc test: FAILED\n", VGA_LIGHT_RED, VGA_BLACK);
+        pmm_get_free_pages() * 4, pmm_get_peak_pages());
+    terminal_printf("  Zones: DMA %d/%d free, normal %d/%d free, high %d/%d free\n",
+        pmm_get_zone_free(ZONE_DMA), pmm_get_zone_total(ZONE_DMA),
+        pmm_get_zone_free(ZONE_NORMAL), pmm_get_zone_total(ZONE_NORMAL),
+        pmm_get_zone_free(ZONE_HIGH), pmm_get_zone_total(ZONE_HIGH));
+    terminal_printf("  Pre-zeroed pages: %d\n", pmm_get_zeroed_pages());
+    if (swap_get_total()) {
+        terminal_printf("  Swap: %d KB used of %d KB\n", swap_get_used() * 4, swap_get_total() * 4);
+    }
+
+    terminal_print("  Free page blocks:");
+    for (uint32_t o = 0; o <= PMM_MAX_ORDER; o++) {
+        uint32_t n = pmm_get_free_blocks(o);
+        if (n) terminal_printf(" %dK:%d", 4 << o, n);
+    }
+    terminal_print("\n");
+
+    uint32_t nshrink;
+    const shrinker_t *shrink = pmm_get_shrinkers(&nshrink);
+    for (uint32_t i = 0; i < nshrink; i++) {
+        terminal_printf("  Shrinker %s: %d runs, %d pages back\n",
+            shrink[i].name, shrink[i].calls, shrink[i].freed);
+    }
+
+    terminal_printf("  Heap: %d bytes used, %d bytes free (%d KB backed), peak %d\n",
+        hs.used, heap_get_free(), heap_get_mapped() / 1024, hs.peak_used);
+    terminal_printf("  Heap free space: %d blocks, largest %d KB, %d%% fragmented, %d KB untouched\n",
+        hs.free_blocks, hs.largest_free / 1024, hs.frag_percent, hs.wilderness / 1024);
+    terminal_printf("  kmalloc: %d calls, %d failed, ~%d cycles each\n",
+        hs.alloc_calls, hs.failed_allocs, avg_cycles(hs.alloc_cycles, hs.alloc_calls));
+    terminal_printf("  kfree:   %d calls, ~%d cycles each\n",
+        hs.free_calls, avg_cycles(hs.free_cycles, hs.free_calls));
+
+    terminal_print("  Live blocks by size:");
+    for (int b = 0; b < HEAP_HIST_BUCKETS; b++) {
+        if (!hs.live_hist[b]) continue;
+        terminal_printf(" %d%s:%d", 16 << b, b == HEAP_HIST_BUCKETS - 1 ? "+" : "",
+            hs.live_hist[b]);
+    }
+    terminal_print("\n");
+
+    for (kmem_cache_t *c = kmem_cache_list(); c; c = c->next) {
+        terminal_printf("  Cache %s: %d/%d objs of %d bytes, %d slabs\n",
+            c->name, c->active_objs, c->total_objs, c->obj_size, c->slabs);
+    }
+
+    if (heap_tracking_callers()) {
+        const heap_site_t *sites = heap_get_sites();
+        for (int i = 0; i < HEAP_SITES; i++) {
+            if (!sites[i].caller || !sites[i].live_allocs) continue;
+            terminal_printf("  Caller %x: %d live, %d bytes\n",
+                sites[i].caller, sites[i].live_allocs, sites[i].live_bytes);
+        }
     }
 }
 
@@ -131,47 +193,74 @@ static void cmd_cat(const char *filename) {
         return;
     }
 
-    /* Use heap to allocate read buffer */
-    uint8_t *buf = (uint8_t *)kmalloc(4096);
-    if (!buf) {
-        terminal_print_colored("Out of memory.\n", VGA_LIGHT_RED, VGA_BLACK);
+    fat_dir_entry_t entry;
+    if (!fat_lookup(filename, &entry)) {
+        terminal_printf("File not found: %s\n", filename);
         return;
     }
+    if (entry.size == 0) return;
 
-    int bytes = fat_read_file(filename, buf, 4095);
-    if (bytes < 0) {
-        terminal_printf("File not found: %s\n", filename);
-    } else {
-        buf[bytes] = '\0';
-        terminal_print((const char *)buf);
-        if (bytes > 0 && buf[bytes - 1] != '\n') terminal_print("\n");
+    /* Mapped, so pages are read from disk as they are printed */
+    uint32_t size;
+    const char *data = (const char *)mmap_map_file(paging_kernel_dir(), filename, 0, &size);
+    if (!data) {
+        terminal_print_colored("Out of memory.\n", VGA_LIGHT_RED, VGA_BLACK);
+        return;
     }
 
-    kfree(buf);
+    for (uint32_t i = 0; i < size; i++) terminal_putchar(data[i]);
+    if (data[size - 1] != '\n') terminal_print("\n");
+
+    mmap_unmap(paging_kernel_dir(), (uint32_t)data);
 }
 
+#define TASKS_SHOWN 32
+
 static void cmd_tasks(void) {
     if (!multitasking_enabled()) {
         terminal_print("Multitasking not initialized.\n");
         return;
     }
 
-    process_t *list = process_get_list();
-    terminal_print_colored("PID  State      Name\n", VGA_LIGHT_CYAN, VGA_BLACK);
-    terminal_print("------------------------\n");
+    /*
+     * Copy what we print with IRQs off: an exited task can be reaped, and
+     * its PCB freed, while we are printing.
+     */
+    struct {
+        uint32_t pid;
+        process_state_t state;
+        uint8_t priority;
+        const char *name;
+    } tasks[TASKS_SHOWN];
+    int shown = 0;
+
+    uint32_t flags = irq_save();
+    int total = process_count();
+    for (process_t *p = process_first(); p && shown < TASKS_SHOWN; p = p->task_next) {
+        tasks[shown].pid = p->pid;
+        tasks[shown].state = p->state;
+        tasks[shown].priority = p->priority;
+        tasks[shown].name = p->name;
+        shown++;
+    }
+    irq_restore(flags);
 
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-        if (list[i].state == PROC_UNUSED) continue;
+    terminal_print_colored("PID  State      Prio  Name\n", VGA_LIGHT_CYAN, VGA_BLACK);
+    terminal_print("------------------------------\n");
 
-        terminal_printf("%d    ", list[i].pid);
+    for (int i = 0; i < shown; i++) {
+        terminal_printf("%d    ", tasks[i].pid);
 
-        switch (list[i].state) {
+        switch (tasks[i].state) {
             case PROC_RUNNING:
                 terminal_print_colored("RUNNING   ", VGA_LIGHT_GREEN, VGA_BLACK);
                 break;
             case PROC_READY:
                 terminal_print_colored("READY     ", VGA_YELLOW, VGA_BLACK);
                 break;
+            case PROC_BLOCKED:
+                terminal_print_colored("BLOCKED   ", VGA_LIGHT_BLUE, VGA_BLACK);
+                break;
             case PROC_TERMINATED:
                 terminal_print_colored("DONE      ", VGA_DARK_GREY, VGA_BLACK);
                 break;
@@ -179,9 +268,36 @@ static void cmd_tasks(void) {
                 terminal_print("???       ");
         }
 
-        terminal_printf("%s\n", list[i].name);
+        terminal_printf("%d     %s\n", tasks[i].priority, tasks[i].name);
     }
-    terminal_printf("\nActive processes: %d\n", process_count());
+    if (total > shown) terminal_printf("... %d more\n", total - shown);
+    terminal_printf("\nActive processes: %d\n", total);
+}
+
+/* Parse a decimal number, advancing *s past it; -1 if there is none */
+static int parse_uint(const char **s) {
+    while (**s == ' ') (*s)++;
+    if (**s < '0' || **s > '9') return -1;
+
+    int value = 0;
+    while (**s >= '0' && **s <= '9') value = value * 10 + (*(*s)++ - '0');
+    return value;
+}
+
+static void cmd_nice(const char *args) {
+    int pid = args ? parse_uint(&args) : -1;
+    int prio = pid >= 0 ? parse_uint(&args) : -1;
+    if (prio < 0) {
+        terminal_print("Usage: nice <pid> <priority 0-7>\n");
+        return;
+    }
+
+    int old = process_set_priority(pid, prio);
+    if (old < 0) {
+        terminal_print_colored("No such task or bad priority.\n", VGA_LIGHT_RED, VGA_BLACK);
+        return;
+    }
+    terminal_printf("PID %d: priority %d -> %d\n", pid, old, prio);
 }
 
 /* Demo tasks for multitasking */
@@ -196,8 +312,7 @@ static void demo_task_a(void) {
         int_to_str(count++, buf);
         terminal_print_colored(buf, VGA_LIGHT_GREEN, VGA_BLACK);
         terminal_print("   ");
-        /* Busy wait for visible delay */
-        for (volatile int i = 0; i < 500000; i++);
+        sleep_ticks(5);
     }
     demo_running--;
 }
@@ -211,7 +326,7 @@ static void demo_task_b(void) {
         int_to_str(count++, buf);
         terminal_print_colored(buf, VGA_LIGHT_CYAN, VGA_BLACK);
         terminal_print("   ");
-        for (volatile int i = 0; i < 700000; i++);
+        sleep_ticks(7);
     }
     demo_running--;
 }
@@ -234,6 +349,10 @@ static void cmd_demo(void) {
         return;
     }
 
+    /* The counters are background work: let the shell win any wakeup race */
+    process_set_priority(pidA, PRIO_BATCH);
+    process_set_priority(pidB, PRIO_BATCH);
+
     terminal_printf("Created tasks: PID %d (A), PID %d (B)\n", pidA, pidB);
     terminal_print("Shell continues to run concurrently.\n");
 }
@@ -243,6 +362,18 @@ static void cmd_uname(void) {
     terminal_print(" v0.2.0 (x86 i386) - built with love and assembly\n");
 }
 
+static void cmd_uptime(void) {
+    uint64_t ns = clock_ns();
+    uint32_t ms = (uint32_t)div64_u32(ns, 1000000);
+    uint32_t secs = ms / 1000;
+
+    terminal_printf("Up %dh %dm %d.", secs / 3600, secs / 60 % 60, secs % 60);
+    ms %= 1000;
+    if (ms < 100) terminal_putchar('0');
+    if (ms < 10) terminal_putchar('0');
+    terminal_printf("%ds (TSC %d MHz, %d ticks)\n", ms, clock_tsc_khz() / 1000, timer_get_ticks());
+}
+
 /* ============================================================
  * Shell input / command dispatch
  * ============================================================ */
@@ -269,13 +400,15 @@ static void execute_command(void) {
     if (strcmp(cmd, "help") == 0)       cmd_help();
     else if (strcmp(cmd, "clear") == 0) cmd_clear();
     else if (strcmp(cmd, "reboot") == 0) cmd_reboot();
-    else if (strcmp(cmd, "meminfo") == 0) cmd_meminfo();
+    else if (strcmp(cmd, "meminfo") == 0) cmd_meminfo(args);
     else if (strcmp(cmd, "echo") == 0)  cmd_echo(args);
     else if (strcmp(cmd, "ls") == 0)    cmd_ls();
     else if (strcmp(cmd, "cat") == 0)   cmd_cat(args);
     else if (strcmp(cmd, "tasks") == 0) cmd_tasks();
+    else if (strcmp(cmd, "nice") == 0)  cmd_nice(args);
     else if (strcmp(cmd, "demo") == 0)  cmd_demo();
     else if (strcmp(cmd, "uname") == 0) cmd_uname();
+    else if (strcmp(cmd, "uptime") == 0) cmd_uptime();
     else {
         terminal_print_colored("Unknown command: ", VGA_LIGHT_RED, VGA_BLACK);
         terminal_printf("%s\n", cmd);
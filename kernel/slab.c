@@ -0,0 +1,183 @@
+#include "slab.h"
+#include "memory.h"
+#include "string.h"
+#include "io.h"
+
+/*
+ * Every object is preceded by one word. While the object is allocated it
+ * points back at its slab (so free is O(1)); while it is free it links
+ * the slab's free list. The object itself is never touched by the cache,
+ * so constructed state survives a free/alloc cycle.
+ */
+typedef struct kmem_slab {
+    struct kmem_slab *next;
+    struct kmem_slab *prev;
+    uint32_t *free_list;
+    uint32_t  in_use;
+} kmem_slab_t;
+
+static kmem_cache_t *cache_list = NULL;
+
+static void slab_unlink(kmem_slab_t **list, kmem_slab_t *slab) {
+    if (slab->prev) slab->prev->next = slab->next;
+    else *list = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+    slab->next = slab->prev = NULL;
+}
+
+static void slab_push(kmem_slab_t **list, kmem_slab_t *slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list) (*list)->prev = slab;
+    *list = slab;
+}
+
+/* Slabs are whole pages from the PMM, header first */
+static kmem_slab_t *slab_grow(kmem_cache_t *cache) {
+    kmem_slab_t *slab = (kmem_slab_t *)pmm_alloc_pages(cache->slab_order);
+    if (!slab) return NULL;
+
+    slab->next = slab->prev = NULL;
+    slab->in_use = 0;
+    slab->free_list = NULL;
+
+    uint8_t *slot = (uint8_t *)(slab + 1);
+    for (uint32_t i = 0; i < cache->objs_per_slab; i++) {
+        uint32_t *hdr = (uint32_t *)slot;
+        if (cache->ctor) cache->ctor(hdr + 1);
+        *hdr = (uint32_t)slab->free_list;
+        slab->free_list = hdr;
+        slot += cache->slot_size;
+    }
+
+    return slab;
+}
+
+/* Shrinker: drop the empty slab every cache keeps for churn */
+static uint32_t slab_shrink_all(uint32_t pages) {
+    (void)pages;
+    uint32_t released = 0;
+    for (kmem_cache_t *c = cache_list; c; c = c->next) released += kmem_cache_shrink(c);
+    return released;
+}
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, void (*ctor)(void *)) {
+    if (size == 0) return NULL;
+
+    kmem_cache_t *cache = (kmem_cache_t *)kmalloc(sizeof(kmem_cache_t));
+    if (!cache) return NULL;
+    memset(cache, 0, sizeof(kmem_cache_t));
+
+    strncpy(cache->name, name, KMEM_NAME_LEN - 1);
+    cache->obj_size = size;
+    cache->slot_size = (sizeof(uint32_t) + size + 3) & ~3;
+    cache->slab_order = pmm_size_to_order(sizeof(kmem_slab_t) + cache->slot_size);
+    cache->objs_per_slab = ((PAGE_SIZE << cache->slab_order) - sizeof(kmem_slab_t)) /
+                           cache->slot_size;
+    cache->ctor = ctor;
+
+    if (!cache_list) pmm_register_shrinker("slab", slab_shrink_all, SHRINK_PRIO_SLAB);
+    cache->next = cache_list;
+    cache_list = cache;
+    return cache;
+}
+
+/*
+ * The slab lists are only touched with IRQs off, so caches may be used
+ * from interrupts. Growing and releasing slabs happen with IRQs on.
+ */
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+    uint32_t flags = irq_save();
+    kmem_slab_t *slab = cache->partial;
+
+    if (!slab) {
+        slab = cache->empty;
+        if (slab) {
+            slab_unlink(&cache->empty, slab);
+        } else {
+            irq_restore(flags);
+            slab = slab_grow(cache);
+            if (!slab) return NULL;
+            flags = irq_save();
+            cache->slabs++;
+            cache->total_objs += cache->objs_per_slab;
+        }
+        slab_push(&cache->partial, slab);
+    }
+
+    uint32_t *hdr = slab->free_list;
+    slab->free_list = (uint32_t *)*hdr;
+    *hdr = (uint32_t)slab;
+    slab->in_use++;
+
+    if (!slab->free_list) {
+        slab_unlink(&cache->partial, slab);
+        slab_push(&cache->full, slab);
+    }
+
+    cache->active_objs++;
+    cache->allocs++;
+    irq_restore(flags);
+    return hdr + 1;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj) {
+    if (!obj) return;
+
+    uint32_t *hdr = (uint32_t *)obj - 1;
+    kmem_slab_t *release = NULL;
+
+    uint32_t flags = irq_save();
+    kmem_slab_t *slab = (kmem_slab_t *)*hdr;
+
+    bool was_full = (slab->free_list == NULL);
+    *hdr = (uint32_t)slab->free_list;
+    slab->free_list = hdr;
+    slab->in_use--;
+
+    if (was_full) {
+        slab_unlink(&cache->full, slab);
+        slab_push(&cache->partial, slab);
+    }
+
+    if (slab->in_use == 0) {
+        slab_unlink(&cache->partial, slab);
+        /* Keep one empty slab around to absorb alloc/free churn */
+        if (cache->empty) {
+            cache->slabs--;
+            cache->total_objs -= cache->objs_per_slab;
+            release = slab;
+        } else {
+            slab_push(&cache->empty, slab);
+        }
+    }
+
+    cache->active_objs--;
+    cache->frees++;
+    irq_restore(flags);
+
+    if (release) pmm_free_pages(release, cache->slab_order);
+}
+
+uint32_t kmem_cache_shrink(kmem_cache_t *cache) {
+    uint32_t released = 0;
+    for (;;) {
+        uint32_t flags = irq_save();
+        kmem_slab_t *slab = cache->empty;
+        if (slab) {
+            slab_unlink(&cache->empty, slab);
+            cache->slabs--;
+            cache->total_objs -= cache->objs_per_slab;
+        }
+        irq_restore(flags);
+        if (!slab) break;
+
+        released += 1u << cache->slab_order;
+        pmm_free_pages(slab, cache->slab_order);
+    }
+    return released;
+}
+
+kmem_cache_t *kmem_cache_list(void) {
+    return cache_list;
+}
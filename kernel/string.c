@@ -1,15 +1,32 @@
 #include "string.h"
 
+/*
+ * The bulk of memset/memcpy is done a dword at a time with rep stos/movs,
+ * which current CPUs run at cache-line speed, and the odd bytes after.
+ */
 void *memset(void *dest, int val, size_t count) {
-    uint8_t *d = (uint8_t *)dest;
-    while (count--) *d++ = (uint8_t)val;
+    uint32_t fill = (uint8_t)val * 0x01010101u;
+    void *d = dest;
+    size_t dwords = count / 4;
+    __asm__ volatile("rep stosl" : "+D"(d), "+c"(dwords) : "a"(fill) : "memory");
+    count &= 3;
+    __asm__ volatile("rep stosb" : "+D"(d), "+c"(count) : "a"(fill) : "memory");
+    return dest;
+}
+
+void *memset32(uint32_t *dest, uint32_t val, size_t count) {
+    void *d = dest;
+    __asm__ volatile("rep stosl" : "+D"(d), "+c"(count) : "a"(val) : "memory");
     return dest;
 }
 
 void *memcpy(void *dest, const void *src, size_t count) {
-    uint8_t *d = (uint8_t *)dest;
-    const uint8_t *s = (const uint8_t *)src;
-    while (count--) *d++ = *s++;
+    void *d = dest;
+    const void *s = src;
+    size_t dwords = count / 4;
+    __asm__ volatile("rep movsl" : "+D"(d), "+S"(s), "+c"(dwords) :: "memory");
+    count &= 3;
+    __asm__ volatile("rep movsb" : "+D"(d), "+S"(s), "+c"(count) :: "memory");
     return dest;
 }
 
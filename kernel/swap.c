@@ -0,0 +1,203 @@
+#include "swap.h"
+#include "memory.h"
+#include "process.h"
+#include "ata.h"
+#include "fat.h"
+#include "io.h"
+#include "string.h"
+
+/*
+ * Swap area: the sectors of the data disk past the end of the FAT volume,
+ * cut into page-sized slots. A swapped-out page leaves a non-present PTE
+ * holding PG_SWAPPED, its slot number and the page's protection bits.
+ * Slots are reference counted because fork copies such PTEs as they are;
+ * one reference per task can never reach the 16-bit count's limit.
+ */
+#define SECTORS_PER_SLOT (PAGE_SIZE / 512)
+#define SWAP_MAX_SLOTS   4096      /* 16 MB */
+#define SWAP_MIN_SLOTS   16
+#define SWAP_KEEP_BITS   (PG_WRITE | PG_USER | PG_COW | PG_NX)
+
+static uint32_t swap_lba = 0;
+static uint32_t swap_slots = 0;
+static uint32_t swap_used = 0;
+static uint32_t slot_hint = 0;
+static uint16_t slot_refs[SWAP_MAX_SLOTS];
+
+/* Clock hand: a process slot and a user address within it */
+static uint32_t hand_pid = 0;
+static uint32_t hand_addr = USER_BASE;
+static bool reclaiming = false;
+
+bool swap_init(void) {
+    uint32_t start = fat_volume_sectors();
+    uint32_t disk = ata_get_sectors();
+    if (!start) return false;
+
+    start = (start + SECTORS_PER_SLOT - 1) & ~(SECTORS_PER_SLOT - 1);
+    if (disk < start + SWAP_MIN_SLOTS * SECTORS_PER_SLOT) return false;
+
+    uint32_t slots = (disk - start) / SECTORS_PER_SLOT;
+    swap_lba = start;
+    swap_slots = slots < SWAP_MAX_SLOTS ? slots : SWAP_MAX_SLOTS;
+    swap_used = 0;
+    memset(slot_refs, 0, sizeof(slot_refs));
+    pmm_register_shrinker("swap", swap_reclaim, SHRINK_PRIO_SWAP);
+    return true;
+}
+
+static uint32_t slot_alloc(void) {
+    for (uint32_t n = 0; n < swap_slots; n++) {
+        uint32_t slot = (slot_hint + n) % swap_slots;
+        if (!slot_refs[slot]) {
+            slot_refs[slot] = 1;
+            slot_hint = slot + 1;
+            swap_used++;
+            return slot;
+        }
+    }
+    return SWAP_MAX_SLOTS;
+}
+
+void swap_slot_dup(pte_t entry) {
+    uint32_t slot = (uint32_t)entry >> 12;
+    if (slot < swap_slots && slot_refs[slot] < 0xFFFF) slot_refs[slot]++;
+}
+
+void swap_slot_free(pte_t entry) {
+    uint32_t slot = (uint32_t)entry >> 12;
+    if (slot >= swap_slots || !slot_refs[slot]) return;
+    if (--slot_refs[slot] == 0) swap_used--;
+}
+
+static uint32_t slot_lba(uint32_t slot) {
+    return swap_lba + slot * SECTORS_PER_SLOT;
+}
+
+/* Write one private page out and leave a swap entry in its PTE */
+static bool swap_out(uint32_t dir, pte_t *pte, uint32_t virt) {
+    uint32_t flags = irq_save();
+    bool ok = false;
+
+    uint32_t slot = slot_alloc();
+    if (slot < SWAP_MAX_SLOTS) {
+        uint32_t pfn = PTE_PFN(*pte);
+        void *page = kmap(pfn);
+        bool written = page && ata_write_sectors(slot_lba(slot), SECTORS_PER_SLOT, page);
+        if (page) kunmap(page);
+
+        if (written) {
+            pte_set(pte, (slot << 12) | (*pte & SWAP_KEEP_BITS) | PG_SWAPPED);
+            paging_invalidate(dir, virt);
+            pmm_page_put(pfn);
+            ok = true;
+        } else {
+            /* The write failed: the page stays resident */
+            swap_slot_free(slot << 12);
+        }
+    }
+
+    irq_restore(flags);
+    return ok;
+}
+
+/*
+ * Clock scan over the user pages of every process. A page whose accessed
+ * bit is set gets a second chance: the bit is cleared and the hand moves
+ * on. A page still unreferenced when the hand comes back is written out.
+ * Only single-reference pages qualify; the other PTEs of a shared page
+ * can't be found from its frame. Gives up after two sweeps.
+ */
+/*
+ * Advance the hand by one page, or on to the next task. Runs with IRQs
+ * off, so nothing can schedule and reap the task or free its page tables
+ * between the PTE lookup and swap_out(). False when the hand changed task.
+ */
+static bool clock_step(uint32_t *freed) {
+    /* The hand remembers a PID, not a PCB: its task may be gone by now */
+    process_t *p = process_find(hand_pid);
+    bool usable = p && p->is_user && p->state != PROC_TERMINATED;
+
+    if (!usable || hand_addr >= USER_TOP) {
+        process_t *next = (p && p->task_next) ? p->task_next : process_first();
+        hand_pid = next->pid;
+        hand_addr = USER_BASE;
+        return false;
+    }
+
+    pte_t *pte = paging_user_pte(p->page_dir, hand_addr);
+    if (!pte) {
+        hand_addr = (hand_addr | (LARGE_PAGE_SIZE - 1)) + 1;
+        return true;
+    }
+
+    uint32_t virt = hand_addr;
+    hand_addr += PAGE_SIZE;
+
+    if (!(*pte & PG_PRESENT)) return true;
+    if (*pte & PG_ACCESSED) {
+        *(uint32_t *)pte &= ~PG_ACCESSED;
+        paging_invalidate(p->page_dir, virt);
+        return true;
+    }
+    if (pmm_page_refs(PTE_PFN(*pte)) != 1) return true;
+
+    if (swap_out(p->page_dir, pte, virt)) (*freed)++;
+    return true;
+}
+
+/*
+ * Clock scan over the user pages of every process. A page whose accessed
+ * bit is set gets a second chance: the bit is cleared and the hand moves
+ * on. A page still unreferenced when the hand comes back is written out.
+ * Only single-reference pages qualify; the other PTEs of a shared page
+ * can't be found from its frame. Gives up after two sweeps. The disk
+ * cache is flushed once per batch rather than once per page.
+ */
+uint32_t swap_reclaim(uint32_t pages) {
+    if (!swap_slots || reclaiming || !multitasking_enabled()) return 0;
+    reclaiming = true;
+
+    uint32_t freed = 0;
+    uint32_t visited = 0;
+    uint32_t sweep = 2 * process_count() + 1;
+
+    while (freed < pages && visited < sweep) {
+        uint32_t flags = irq_save();
+        if (!clock_step(&freed)) visited++;
+        irq_restore(flags);
+    }
+    if (freed) ata_flush();
+
+    reclaiming = false;
+    return freed;
+}
+
+/* Bring a swapped page back into the PTE that refers to it */
+bool swap_fault_in(pte_t *pte) {
+    pte_t entry = *pte;
+    uint32_t slot = (uint32_t)entry >> 12;
+    if (!(entry & PG_SWAPPED) || slot >= swap_slots) return false;
+
+    uint32_t pfn = pmm_alloc_user_frame(false);
+    void *page = pfn ? kmap(pfn) : NULL;
+    bool read = page && ata_read_sectors(slot_lba(slot), SECTORS_PER_SLOT, page);
+    if (page) kunmap(page);
+    if (!read) {
+        if (pfn) pmm_page_put(pfn);
+        return false;
+    }
+
+    /* Not-present entries are never cached, so no flush is needed */
+    pte_set(pte, ((pte_t)pfn << 12) | (entry & SWAP_KEEP_BITS) | PG_PRESENT);
+    swap_slot_free(entry);
+    return true;
+}
+
+uint32_t swap_get_total(void) {
+    return swap_slots;
+}
+
+uint32_t swap_get_used(void) {
+    return swap_used;
+}
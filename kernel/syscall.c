@@ -4,6 +4,30 @@
 #include "keyboard.h"
 #include "process.h"
 #include "io.h"
+#include "mmap.h"
+#include "clock.h"
+#include "memory.h"
+
+#define USER_PATH_MAX 64
+
+/*
+ * A NUL-terminated string of at most `max` bytes lying in user space of
+ * `dir`, on pages that are mapped there (or swapped out, which the fault
+ * handler brings back when the string is read).
+ */
+static bool user_string_ok(uint32_t dir, uint32_t addr, uint32_t max) {
+    for (uint32_t i = 0; i < max; i++) {
+        uint32_t a = addr + i;
+        if (a < addr) return false;
+
+        if (!i || (a & (PAGE_SIZE - 1)) == 0) {
+            pte_t *pte = paging_user_pte(dir, a);
+            if (!pte || !(*pte & (PG_PRESENT | PG_SWAPPED)) || !(*pte & PG_USER)) return false;
+        }
+        if (*(const char *)a == '\0') return true;
+    }
+    return false;
+}
 
 void syscall_handler(registers_t *regs) {
     switch (regs->eax) {
@@ -29,6 +53,46 @@ void syscall_handler(registers_t *regs) {
             schedule();
             break;
 
+        case SYS_FORK:
+            regs->eax = (uint32_t)process_fork(regs);
+            break;
+
+        /* The caller's address space is the one loaded in CR3 */
+        case SYS_MMAP:
+            if ((regs->cs & 0x03) == 3 && !user_string_ok(read_cr3(), regs->ebx, USER_PATH_MAX)) {
+                regs->eax = 0;
+                break;
+            }
+            regs->eax = mmap_map_file(read_cr3(), (const char *)regs->ebx, regs->ecx, NULL);
+            break;
+
+        case SYS_MUNMAP:
+            regs->eax = mmap_unmap(read_cr3(), regs->ebx) ? 0 : (uint32_t)-1;
+            break;
+
+        case SYS_SLEEP:
+            sleep_ticks(regs->ebx);
+            regs->eax = 0;
+            break;
+
+        case SYS_CLOCK: {
+            uint64_t ns = clock_ns();
+            regs->eax = (uint32_t)ns;
+            regs->edx = (uint32_t)(ns >> 32);
+            break;
+        }
+
+        /* User tasks may only make themselves less urgent */
+        case SYS_SETPRIO: {
+            process_t *self = process_current();
+            if (self->is_user && regs->ebx < self->priority) {
+                regs->eax = (uint32_t)-1;
+                break;
+            }
+            regs->eax = (uint32_t)process_set_priority(self->pid, regs->ebx);
+            break;
+        }
+
         default:
             regs->eax = (uint32_t)-1;
             break;
@@ -0,0 +1,143 @@
+#include "timer.h"
+#include "idt.h"
+#include "io.h"
+
+/*
+ * Five levels of 64 slots. Level 0 holds the timers due within the next
+ * 64 ticks, one slot per tick; each higher level covers 64 times the span
+ * of the one below with slots as wide as that whole level. Whenever level
+ * n wraps around, the next slot of level n + 1 is cascaded: its timers are
+ * re-inserted and land one or more levels lower. Insertion is a shift and
+ * a list push, and each tick touches one slot plus the occasional cascade.
+ * Expiries past 2^30 ticks (about four months at 100 Hz) are clamped.
+ */
+#define WHEEL_BITS   6
+#define WHEEL_SLOTS  (1u << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 5
+#define WHEEL_SPAN   ((1u << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+static timer_t *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static uint32_t wheel_now = 0;     /* next tick to be processed */
+
+static void list_add(timer_t **head, timer_t *t) {
+    t->next = *head;
+    if (t->next) t->next->pprev = &t->next;
+    t->pprev = head;
+    *head = t;
+}
+
+static void list_del(timer_t *t) {
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+static void wheel_insert(timer_t *t) {
+    uint32_t delta = t->expires - wheel_now;
+
+    /* Already due: the slot about to be processed */
+    if ((int32_t)delta < 0) {
+        list_add(&wheel[0][wheel_now & WHEEL_MASK], t);
+        return;
+    }
+    if (delta > WHEEL_SPAN) {
+        delta = WHEEL_SPAN;
+        t->expires = wheel_now + delta;
+    }
+
+    int level = 0;
+    while (delta >> (WHEEL_BITS * (level + 1))) level++;
+    list_add(&wheel[level][(t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK], t);
+}
+
+/* Re-file the timers of level's current slot; returns that slot index */
+static uint32_t cascade(int level) {
+    uint32_t idx = (wheel_now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    timer_t *t = wheel[level][idx];
+    wheel[level][idx] = NULL;
+
+    while (t) {
+        timer_t *next = t->next;
+        t->pprev = NULL;
+        wheel_insert(t);
+        t = next;
+    }
+    return idx;
+}
+
+void timer_setup(timer_t *t, timer_fn_t fn, void *arg) {
+    t->next = NULL;
+    t->pprev = NULL;
+    t->expires = 0;
+    t->period = 0;
+    t->fn = fn;
+    t->arg = arg;
+}
+
+void timer_add(timer_t *t, uint32_t expires) {
+    uint32_t flags = irq_save();
+    if (t->pprev) list_del(t);
+    t->expires = expires;
+    wheel_insert(t);
+    irq_restore(flags);
+}
+
+void timer_add_periodic(timer_t *t, uint32_t period) {
+    t->period = period ? period : 1;
+    timer_add(t, timer_get_ticks() + t->period);
+}
+
+bool timer_cancel(timer_t *t) {
+    uint32_t flags = irq_save();
+    bool pending = t->pprev != NULL;
+    if (pending) list_del(t);
+    t->period = 0;
+    irq_restore(flags);
+    return pending;
+}
+
+/*
+ * Stops at the first tick with a level-0 slot to fire or a cascade to do.
+ * Timers further out are in upper levels and come down at a cascade.
+ */
+uint32_t timer_idle_ticks(uint32_t limit) {
+    for (uint32_t n = 1; n < limit; n++) {
+        uint32_t tick = wheel_now + n - 1;
+        if (wheel[0][tick & WHEEL_MASK] || !(tick & WHEEL_MASK)) return n;
+    }
+    return limit;
+}
+
+void timer_run(uint32_t now) {
+    while ((int32_t)(now - wheel_now) >= 0) {
+        uint32_t idx = wheel_now & WHEEL_MASK;
+        for (int level = 1; !idx && level < WHEEL_LEVELS; level++) idx = cascade(level);
+
+        /*
+         * Detach the slot before firing it. The clock moves on first, so a
+         * timer armed for "now" by a callback lands in the next slot to be
+         * processed instead of this one. Callbacks may also cancel timers
+         * still on the detached list.
+         */
+        timer_t *due = NULL;
+        timer_t **slot = &wheel[0][wheel_now & WHEEL_MASK];
+        if (*slot) {
+            due = *slot;
+            due->pprev = &due;
+            *slot = NULL;
+        }
+        wheel_now++;
+
+        while (due) {
+            timer_t *t = due;
+            list_del(t);
+            if (t->period) {
+                t->expires += t->period;
+                wheel_insert(t);
+            }
+            t->fn(t->arg);
+        }
+    }
+}
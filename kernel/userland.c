@@ -18,6 +18,15 @@ static void sys_exit(void) {
     );
 }
 
+static void sys_sleep(uint32_t ticks) {
+    __asm__ volatile(
+        "int $0x80"
+        :
+        : "a"(8), "b"(ticks)
+        : "memory"
+    );
+}
+
 static uint32_t user_strlen(const char *s) {
     uint32_t len = 0;
     while (s[len]) len++;
@@ -36,7 +45,7 @@ void userland_main(void) {
         char msg[] = "  User tick: X\n";
         msg[13] = '0' + i;
         sys_write(msg, 15);
-        for (volatile int j = 0; j < 2000000; j++);
+        sys_sleep(20);
     }
 
     user_print("User process exiting.\n");
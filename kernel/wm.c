@@ -8,6 +8,9 @@
 #include "idt.h"
 #include "process.h"
 #include "io.h"
+#include "timer.h"
+#include "clock.h"
+#include "div64.h"
 
 static uint32_t *backbuf = NULL;
 static uint32_t screen_w, screen_h, screen_pitch;
@@ -20,7 +23,15 @@ static bool dragging = false;
 static int  drag_win = -1;
 static int  drag_off_x, drag_off_y;
 
-static uint32_t last_tick = 0;
+/* Refreshes the info window and taskbar clock twice a second */
+#define WM_REFRESH_TICKS 50
+
+static void refresh_tick(void *arg) {
+    (void)arg;
+    event_push_timer(timer_get_ticks());
+}
+
+static timer_t refresh_timer = TIMER_INIT(refresh_tick, NULL);
 
 
 static void bb_putpixel(int x, int y, uint32_t color) {
@@ -37,9 +48,7 @@ static void bb_fill_rect(int x, int y, int w, int h, uint32_t color) {
         int x0 = x < 0 ? 0 : x;
         int x1 = x + w;
         if ((uint32_t)x1 > screen_w) x1 = screen_w;
-        for (int col = x0; col < x1; col++) {
-            line[col] = color;
-        }
+        if (x0 < x1) memset32(&line[x0], color, x1 - x0);
     }
 }
 
@@ -107,14 +116,10 @@ void wm_init(void) {
     screen_pitch = fb_get_pitch();
 
     uint32_t bb_size = screen_pitch * screen_h;
-    uint32_t pages_needed = (bb_size + 4095) / 4096;
-    backbuf = (uint32_t *)pmm_alloc_page();
+    backbuf = (uint32_t *)pmm_alloc_pages(pmm_size_to_order(bb_size));
     if (!backbuf) return;
-    for (uint32_t i = 1; i < pages_needed; i++) {
-        pmm_alloc_page();
-    }
 
-    memset(backbuf, 0, bb_size);
+    /* No need to clear backbuf: every frame repaints it edge to edge */
     memset(windows, 0, sizeof(windows));
     memset(zorder, 0, sizeof(zorder));
     num_windows = 0;
@@ -165,11 +170,7 @@ int wm_create_window(const char *title, int x, int y, int w, int h) {
 
     uint32_t buf_size = cw * ch * 4;
     windows[id].content = (uint32_t *)kmalloc(buf_size);
-    if (windows[id].content) {
-        for (int i = 0; i < cw * ch; i++) {
-            windows[id].content[i] = FB_WINDOW_BG;
-        }
-    }
+    if (windows[id].content) memset32(windows[id].content, FB_WINDOW_BG, cw * ch);
 
     for (int i = 0; i < WM_MAX_WINDOWS; i++) {
         if (i != id && windows[i].visible) windows[i].focused = false;
@@ -208,10 +209,7 @@ void wm_destroy_window(int id) {
 
 void wm_fill_window(int id, uint32_t color) {
     if (id < 0 || id >= WM_MAX_WINDOWS || !windows[id].content) return;
-    int total = windows[id].content_w * windows[id].content_h;
-    for (int i = 0; i < total; i++) {
-        windows[id].content[i] = color;
-    }
+    memset32(windows[id].content, color, windows[id].content_w * windows[id].content_h);
 }
 
 void wm_draw_to_window(int id, uint32_t x, uint32_t y, char c, uint32_t fg, uint32_t bg) {
@@ -247,9 +245,7 @@ static void draw_desktop(void) {
         uint8_t g = 40 + (y * 40) / screen_h;
         uint8_t b = 100 + (y * 60) / screen_h;
         uint32_t color = ((uint32_t)b) | ((uint32_t)g << 8) | ((uint32_t)r << 16);
-        for (uint32_t x = 0; x < screen_w; x++) {
-            line[x] = color;
-        }
+        memset32(line, color, screen_w);
     }
 }
 
@@ -281,17 +277,17 @@ static void draw_window(int id) {
     int content_y = wy + WM_TITLEBAR_H;
 
     if (w->content) {
-        for (int row = 0; row < w->content_h; row++) {
+        /* Clip the columns once, then copy each visible row in one go */
+        int col0 = content_x < 0 ? -content_x : 0;
+        int col1 = w->content_w;
+        if (content_x + col1 > (int)screen_w) col1 = (int)screen_w - content_x;
+
+        for (int row = 0; row < w->content_h && col0 < col1; row++) {
             int sy = content_y + row;
             if (sy < 0 || (uint32_t)sy >= screen_h) continue;
             uint32_t *dst_line = (uint32_t *)((uint8_t *)backbuf + sy * screen_pitch);
             uint32_t *src_line = w->content + row * w->content_w;
-            for (int col = 0; col < w->content_w; col++) {
-                int sx = content_x + col;
-                if (sx >= 0 && (uint32_t)sx < screen_w) {
-                    dst_line[sx] = src_line[col];
-                }
-            }
+            memcpy(&dst_line[content_x + col0], &src_line[col0], (col1 - col0) * 4);
         }
     } else {
         bb_fill_rect(content_x, content_y, w->content_w, w->content_h, FB_WINDOW_BG);
@@ -307,8 +303,7 @@ static void update_system_info_window(void) {
 
             wm_draw_string_to_window(i, 16, 12, "System Information", 0x000000, FB_WINDOW_BG);
 
-            uint32_t ticks = timer_get_ticks();
-            uint32_t secs = ticks / 100;
+            uint32_t secs = (uint32_t)div64_u32(clock_ns(), 1000000000);
             uint32_t mins = secs / 60;
             secs %= 60;
 
@@ -385,8 +380,7 @@ static void draw_taskbar(void) {
         btn_x += 124;
     }
 
-    uint32_t ticks = timer_get_ticks();
-    uint32_t secs = ticks / 100;
+    uint32_t secs = (uint32_t)div64_u32(clock_ns(), 1000000000);
     uint32_t mins = secs / 60;
     uint32_t hrs = mins / 60;
     mins %= 60;
@@ -567,6 +561,8 @@ static void handle_mouse_move(int mx, int my) {
 
 
 void wm_run(void) {
+    timer_add_periodic(&refresh_timer, WM_REFRESH_TICKS);
+
     while (1) {
         event_t e;
         while (event_poll(&e)) {
@@ -580,6 +576,9 @@ void wm_run(void) {
                 case EVENT_MOUSE_MOVE:
                     handle_mouse_move(e.mouse_move.x, e.mouse_move.y);
                     break;
+                case EVENT_TIMER:
+                    update_system_info_window();
+                    break;
                 case EVENT_KEY_PRESS:
                     break;
                 default:
@@ -587,13 +586,9 @@ void wm_run(void) {
             }
         }
 
-        uint32_t now = timer_get_ticks();
-        if (now - last_tick >= 50) {
-            last_tick = now;
-            update_system_info_window();
-        }
-
         wm_compose();
-        hlt();
+
+        /* Sleep until input arrives or the refresh timer fires */
+        event_wait(0);
     }
 }